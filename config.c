@@ -19,17 +19,26 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <avr/eeprom.h>
+#include <util/crc16.h>
 #include "lib/inih/ini.h"
 #include "config.h"
 #include "lib/ff/diskio.h"
 #include "debug.h"
+#include "net.h"
 
 /*
  * The configuration keys and values we check for, in flash to save precious
  * SRAM for other uses.
  */
+static const __flash char str_allow[] =     "allow";
+static const __flash char str_auto[] =      "auto";
+static const __flash char str_batch[] =     "batch";
+static const __flash char str_burst[] =     "burst";
 static const __flash char str_dayna[] =     "dayna";
 static const __flash char str_debug[] =     "debug";
+static const __flash char str_delay[] =     "delay";
 static const __flash char str_driver[] =    "driver";
 static const __flash char str_ethernet[] =  "ethernet";
 static const __flash char str_fast[] =      "fast";
@@ -37,19 +46,66 @@ static const __flash char str_file[] =      "file";
 static const __flash char str_forcefast[] = "forcefast";
 static const __flash char str_hdd[] =       "hdd";
 static const __flash char str_id[] =        "id";
+static const __flash char str_lba[] =       "lba";
+static const __flash char str_limit[] =     "limit";
 static const __flash char str_mac[] =       "mac";
+static const __flash char str_mindelay[] =  "mindelay";
 static const __flash char str_mode[] =      "mode";
 static const __flash char str_normal[] =    "normal";
 static const __flash char str_nuvo[] =      "nuvo";
+static const __flash char str_overlay[] =   "overlay";
 static const __flash char str_parity[] =    "parity";
+static const __flash char str_partition[] = "partition";
 static const __flash char str_scuznet[] =   "scuznet";
+static const __flash char str_sectors[] =   "sectors";
 static const __flash char str_selftest[] =  "selftest";
 static const __flash char str_size[] =      "size";
+static const __flash char str_sparse[] =    "sparse";
+static const __flash char str_throttle[] =  "throttle";
 static const __flash char str_verbose[] =   "verbose";
+static const __flash char str_xmit[] =      "xmit";
 static const __flash char str_yes[] =       "yes";
 
-ENETConfig config_enet = { 255, 0, LINK_NONE, { 0x02, 0x00, 0x00, 0x00, 0x00, 0x00} };
+/*
+ * The parsed configuration is cached in EEPROM, keyed to the size, timestamp
+ * and a CRC of the contents of SCUZNET.INI, so the parser only needs to run
+ * when the file has changed. The timestamp alone has two second resolution and
+ * may not be set at all by some hosts, hence the CRC. Increment the version
+ * whenever the layout or meaning of the cached values changes.
+ */
+#define CONFIG_CACHE_VERSION    10
+#define CONFIG_CACHE_FLAGS      (GLOBAL_FLAG_PARITY | GLOBAL_FLAG_DEBUG \
+		| GLOBAL_FLAG_VERBOSE | GLOBAL_FLAG_SELFTEST)
+typedef struct ConfigCacheHDD_t {
+	uint8_t id;
+	char filename[HDD_FILENAME_SIZE];
+	uint32_t size;
+	HDDMODE mode;
+	uint32_t lba;
+	uint8_t part;
+} ConfigCacheHDD;
+typedef struct ConfigCacheOverlay_t {
+	uint8_t hdd;
+	char filename[HDD_FILENAME_SIZE];
+} ConfigCacheOverlay;
+typedef struct ConfigCache_t {
+	uint8_t version;
+	FSIZE_t ini_size;
+	WORD ini_date;
+	WORD ini_time;
+	uint16_t ini_crc;
+	uint8_t flags;
+	ENETConfig enet;
+	ConfigCacheHDD hdd[HARD_DRIVE_COUNT];
+	ConfigCacheOverlay overlay[HDD_OVERLAY_COUNT];
+	uint16_t crc;               // must be last
+} ConfigCache;
+static ConfigCache EEMEM config_cache;
+
+ENETConfig config_enet = { 255, 0, LINK_NONE, { 0x02, 0x00, 0x00, 0x00, 0x00, 0x00},
+		0, 100, 30, 1, 0, { 0 }, 0, 16, NET_XMIT_BUFFERS_MAX };
 HDDConfig config_hdd[HARD_DRIVE_COUNT];
+HDDOverlay config_overlay[HDD_OVERLAY_COUNT];
 uint8_t global_buffer[GLOBAL_BUFFER_SIZE];
 
 /*
@@ -75,6 +131,17 @@ static uint8_t strnequ(const char* a, const __flash char* b, uint8_t l)
 	return *a == *b;
 }
 
+/*
+ * Parses a decimal value, returning false if the string is not entirely a
+ * number, so that typos are caught rather than being read as zero.
+ */
+static uint8_t config_decimal(const char* value, long* v)
+{
+	char* end;
+	*v = strtol(value, &end, 10);
+	return end != value && *end == '\0';
+}
+
 /*
  * INIH callback for configuration information.
  */
@@ -84,7 +151,8 @@ static int config_handler(
 	const char* name,
 	const char* value)
 {
-	(void) user; // silence compiler
+	// holds each drive's 'size' in MB until the whole file has been read
+	uint32_t* size_mb = (uint32_t*) user;
 
 	if (strequ(section, str_scuznet))
 	{
@@ -177,6 +245,93 @@ static int config_handler(
 
 			return 1;
 		}
+		else if (strequ(name, str_batch))
+		{
+			if (strequ(value, str_yes))
+			{
+				config_enet.batch = 1;
+			}
+			return 1;
+		}
+		else if (strequ(name, str_delay))
+		{
+			if (strequ(value, str_auto))
+			{
+				config_enet.delay = LINK_DELAY_AUTO;
+				return 1;
+			}
+			long v;
+			if (! config_decimal(value, &v)) return 0;
+			if (v >= 0 && v < LINK_DELAY_AUTO)
+			{
+				config_enet.delay = (uint8_t) v;
+			}
+			return 1;
+		}
+		else if (strequ(name, str_mindelay))
+		{
+			long v;
+			if (! config_decimal(value, &v)) return 0;
+			if (v >= 0 && v < LINK_DELAY_AUTO)
+			{
+				config_enet.delay_min = (uint8_t) v;
+			}
+			return 1;
+		}
+		else if (strequ(name, str_allow))
+		{
+			// comma-separated list of hex values, either an 802.2 DSAP below
+			// 0x0100 or an EtherType from 0x0600 up
+			config_enet.allow_count = 0;
+			const char* p = value;
+			while (*p != '\0' && config_enet.allow_count < LINK_ALLOW_MAX)
+			{
+				char* end;
+				long v = strtol(p, &end, 16);
+				if (end == p || v < 0 || v > 0xFFFF) return 0;
+				if (v >= 0x0100 && v < 0x0600) return 0;
+				config_enet.allow[config_enet.allow_count++] = (uint16_t) v;
+				p = end;
+				while (*p == ',' || *p == ' ') p++;
+			}
+			return 1;
+		}
+		else if (strequ(name, str_limit))
+		{
+			long v = atol(value);
+			if (v >= 0 && v <= LINK_LIMIT_MAX)
+			{
+				config_enet.limit = (uint16_t) v;
+			}
+			return 1;
+		}
+		else if (strequ(name, str_burst))
+		{
+			int v = atoi(value);
+			if (v >= 1 && v <= 255)
+			{
+				config_enet.burst = (uint8_t) v;
+			}
+			return 1;
+		}
+		else if (strequ(name, str_xmit))
+		{
+			int v = atoi(value);
+			if (v >= 1 && v <= NET_XMIT_BUFFERS_MAX)
+			{
+				config_enet.xmit = (uint8_t) v;
+			}
+			return 1;
+		}
+		else if (strequ(name, str_throttle))
+		{
+			int v = atoi(value);
+			if (v >= 0 && v <= 255)
+			{
+				config_enet.throttle = (uint8_t) v;
+			}
+			return 1;
+		}
 		else
 		{
 			return 0;
@@ -196,7 +351,7 @@ static int config_handler(
 			default:
 				hddsel = 255;
 		}
-		if (hddsel > HARD_DRIVE_COUNT) return 0;
+		if (hddsel >= HARD_DRIVE_COUNT) return 0;
 
 		if (strequ(name, str_id))
 		{
@@ -222,7 +377,54 @@ static int config_handler(
 		}
 		else if (strequ(name, str_size))
 		{
-			config_hdd[hddsel].size = ((uint16_t) atoi(value));
+			size_mb[hddsel] = strtoul(value, NULL, 10);
+			return 1;
+		}
+		else if (strequ(name, str_partition))
+		{
+			int v = atoi(value);
+			if (v >= 1 && v <= 4)
+			{
+				config_hdd[hddsel].part = (uint8_t) v;
+				return 1;
+			}
+			else
+			{
+				return 0;
+			}
+		}
+		else if (strequ(name, str_lba))
+		{
+			config_hdd[hddsel].lba = strtoul(value, NULL, 10);
+			return 1;
+		}
+		else if (strequ(name, str_sectors))
+		{
+			config_hdd[hddsel].size = strtoul(value, NULL, 10);
+			return 1;
+		}
+		else if (strequ(name, str_overlay))
+		{
+			if (strlen(value) >= HDD_FILENAME_SIZE) return 0;
+
+			// use this drive's overlay if it has one, or the next free one
+			HDDOverlay* ov = NULL;
+			for (uint8_t i = 0; i < HDD_OVERLAY_COUNT; i++)
+			{
+				if (config_overlay[i].hdd == hddsel)
+				{
+					ov = &(config_overlay[i]);
+					break;
+				}
+				else if (config_overlay[i].hdd == 255 && ov == NULL)
+				{
+					ov = &(config_overlay[i]);
+				}
+			}
+			if (ov == NULL) return 0;
+
+			ov->hdd = hddsel;
+			strncpy(ov->filename, value, sizeof(ov->filename));
 			return 1;
 		}
 		else if (strequ(name, str_mode))
@@ -242,6 +444,11 @@ static int config_handler(
 				config_hdd[hddsel].mode = HDD_MODE_NORMAL;
 				return 1;
 			}
+			else if (strequ(value, str_sparse))
+			{
+				config_hdd[hddsel].mode = HDD_MODE_SPARSE;
+				return 1;
+			}
 			else
 			{
 				return 0;
@@ -258,6 +465,128 @@ static int config_handler(
 	}
 }
 
+/*
+ * ============================================================================
+ *  
+ *   CONFIGURATION CACHE
+ * 
+ * ============================================================================
+ * 
+ * Both of these use the global buffer to stage the cache contents, since it is
+ * otherwise unused this early during startup.
+ */
+
+static uint16_t config_cache_crc(ConfigCache* cache)
+{
+	uint8_t* p = (uint8_t*) cache;
+	uint16_t crc = 0xFFFF;
+	for (uint16_t i = 0; i < offsetof(ConfigCache, crc); i++)
+	{
+		crc = _crc_ccitt_update(crc, p[i]);
+	}
+	return crc;
+}
+
+/*
+ * Calculates the CRC of the contents of the open SCUZNET.INI, leaving the
+ * file positioned at the start again for parsing.
+ */
+static FRESULT config_ini_crc(FIL* fil, uint16_t* crc)
+{
+	UINT act;
+	*crc = 0xFFFF;
+	do
+	{
+		FRESULT res = f_read(fil, global_buffer, 512, &act);
+		if (res) return res;
+		for (UINT i = 0; i < act; i++)
+		{
+			*crc = _crc_ccitt_update(*crc, global_buffer[i]);
+		}
+	}
+	while (act == 512);
+	return f_lseek(fil, 0);
+}
+
+/*
+ * Loads the configuration from the cache if it matches the given file
+ * information and CRC for SCUZNET.INI. Returns true if the cache was used, or
+ * false if the file needs to be parsed.
+ */
+static uint8_t config_cache_load(FILINFO* fno, uint16_t ini_crc)
+{
+	ConfigCache* cache = (ConfigCache*) global_buffer;
+	eeprom_read_block(cache, &config_cache, sizeof(ConfigCache));
+
+	if (cache->version != CONFIG_CACHE_VERSION
+			|| cache->ini_size != fno->fsize
+			|| cache->ini_date != fno->fdate
+			|| cache->ini_time != fno->ftime
+			|| cache->ini_crc != ini_crc
+			|| cache->crc != config_cache_crc(cache))
+	{
+		return 0;
+	}
+
+	GLOBAL_CONFIG_REGISTER |= cache->flags & CONFIG_CACHE_FLAGS;
+	config_enet = cache->enet;
+	for (uint8_t i = 0; i < HARD_DRIVE_COUNT; i++)
+	{
+		config_hdd[i].id = cache->hdd[i].id;
+		memcpy(config_hdd[i].filename, cache->hdd[i].filename,
+				HDD_FILENAME_SIZE);
+		config_hdd[i].size = cache->hdd[i].size;
+		config_hdd[i].mode = cache->hdd[i].mode;
+		config_hdd[i].lba = cache->hdd[i].lba;
+		config_hdd[i].part = cache->hdd[i].part;
+	}
+	for (uint8_t i = 0; i < HDD_OVERLAY_COUNT; i++)
+	{
+		config_overlay[i].hdd = cache->overlay[i].hdd;
+		memcpy(config_overlay[i].filename, cache->overlay[i].filename,
+				HDD_FILENAME_SIZE);
+	}
+	return 1;
+}
+
+/*
+ * Stores the freshly parsed configuration into the cache, along with the given
+ * file information and CRC for SCUZNET.INI.
+ */
+static void config_cache_save(FILINFO* fno, uint16_t ini_crc)
+{
+	ConfigCache* cache = (ConfigCache*) global_buffer;
+	memset(cache, 0, sizeof(ConfigCache));
+
+	cache->version = CONFIG_CACHE_VERSION;
+	cache->ini_size = fno->fsize;
+	cache->ini_date = fno->fdate;
+	cache->ini_time = fno->ftime;
+	cache->ini_crc = ini_crc;
+	cache->flags = GLOBAL_CONFIG_REGISTER & CONFIG_CACHE_FLAGS;
+	cache->enet = config_enet;
+	for (uint8_t i = 0; i < HARD_DRIVE_COUNT; i++)
+	{
+		cache->hdd[i].id = config_hdd[i].id;
+		memcpy(cache->hdd[i].filename, config_hdd[i].filename,
+				HDD_FILENAME_SIZE);
+		cache->hdd[i].size = config_hdd[i].size;
+		cache->hdd[i].mode = config_hdd[i].mode;
+		cache->hdd[i].lba = config_hdd[i].lba;
+		cache->hdd[i].part = config_hdd[i].part;
+	}
+	for (uint8_t i = 0; i < HDD_OVERLAY_COUNT; i++)
+	{
+		cache->overlay[i].hdd = config_overlay[i].hdd;
+		memcpy(cache->overlay[i].filename, config_overlay[i].filename,
+				HDD_FILENAME_SIZE);
+	}
+	cache->crc = config_cache_crc(cache);
+
+	// only rewrites bytes that changed, to spare the EEPROM
+	eeprom_update_block(cache, &config_cache, sizeof(ConfigCache));
+}
+
 /*
  * ============================================================================
  *  
@@ -279,32 +608,72 @@ void config_read(uint8_t* target_masks)
 		config_hdd[i].filename[0] = '\0';
 		config_hdd[i].size = 0;
 		config_hdd[i].mode = HDD_MODE_NORMAL;
+		config_hdd[i].part = 0;
+	}
+	for (uint8_t i = 0; i < HDD_OVERLAY_COUNT; i++)
+	{
+		config_overlay[i].hdd = 255;
+		config_overlay[i].filename[0] = '\0';
 	}
 
-	// open the file off the memory card
+	// find the file off the memory card; its size, timestamp and contents
+	// are used to decide if the cached configuration is still valid
+	FILINFO fno;
 	FIL fil;
-	FRESULT res = f_open(&fil, "SCUZNET.INI", FA_READ);
+	uint16_t ini_crc;
+	FRESULT res = f_stat("SCUZNET.INI", &fno);
+	if (! res) res = f_open(&fil, "SCUZNET.INI", FA_READ);
+	if (! res)
+	{
+		res = config_ini_crc(&fil, &ini_crc);
+		if (res) f_close(&fil);
+	}
 	if (res)
 	{
 		fatal(FATAL_CONFIG_FILE, (uint8_t) res);
 	}
 
-	// execute INIH parse using FatFs f_gets()
-	int pres = ini_parse_stream((ini_reader) f_gets, &fil, config_handler, NULL);
-	if (pres != 0)
+	if (config_cache_load(&fno, ini_crc))
+	{
+		debug(DEBUG_CONFIG_CACHE_USED);
+		f_close(&fil);
+	}
+	else
 	{
-		if (pres < 0)
+		// execute INIH parse using FatFs f_gets()
+		uint32_t size_mb[HARD_DRIVE_COUNT];
+		memset(size_mb, 0, sizeof(size_mb));
+		int pres = ini_parse_stream((ini_reader) f_gets, &fil,
+				config_handler, size_mb);
+		if (pres != 0)
 		{
-			fatal(FATAL_CONFIG_LINE_READ, 0);
+			if (pres < 0)
+			{
+				fatal(FATAL_CONFIG_LINE_READ, 0);
+			}
+			else
+			{
+				uint8_t line = (uint8_t) pres;
+				if (pres > 255) line = 255;
+				fatal(FATAL_CONFIG_LINE_READ, line);
+			}
 		}
-		else
+		f_close(&fil);
+
+		/*
+		 * 'size' is in MB and only applies to image files, while 'sectors'
+		 * is only used for raw volumes, so neither can stand in for the
+		 * other regardless of the order they were given in.
+		 */
+		for (uint8_t i = 0; i < HARD_DRIVE_COUNT; i++)
 		{
-			uint8_t line = (uint8_t) pres;
-			if (pres > 255) line = 255;
-			fatal(FATAL_CONFIG_LINE_READ, line);
+			if (config_hdd[i].part == 0 && config_hdd[i].lba == 0)
+			{
+				config_hdd[i].size = size_mb[i];
+			}
 		}
+		config_cache_save(&fno, ini_crc);
 	}
-	f_close(&fil);
 
 	// override configuration file if asked
 #ifdef FORCE_NUVO
@@ -331,6 +700,13 @@ void config_read(uint8_t* target_masks)
 	}
 	for (uint8_t i = 0; i < HARD_DRIVE_COUNT; i++)
 	{
+		// a partition or LBA range always means raw access, whatever the
+		// mode setting was
+		if (config_hdd[i].part > 0 || config_hdd[i].lba > 0)
+		{
+			config_hdd[i].mode = HDD_MODE_RAW;
+		}
+
 		if (config_hdd[i].id < 7)
 		{
 			config_hdd[i].mask = 1 << config_hdd[i].id;
@@ -63,11 +63,15 @@
 #define GLOBAL_FLAG_SELFTEST             _BV(5)
 
 /*
- * The number of virtual hard drives that can be supported simultaneously.
+ * The number of virtual hard drives that can be supported simultaneously. This
+ * is normally set by the memory profile in the Makefile.
  * 
- * This will break the debug-flash system if increased beyond 4.
+ * The fatal() long flash codes 1 through this value are used for the drives,
+ * with the other long codes following after.
  */
-#define HARD_DRIVE_COUNT        4
+#ifndef HARD_DRIVE_COUNT
+	#define HARD_DRIVE_COUNT    4
+#endif
 
 /*
  * The Ethernet controller configuration information.
@@ -77,6 +81,15 @@ typedef struct ENETConfig_t {
 	uint8_t mask;               // the bitmask for the above ID
 	LINKTYPE type;
 	uint8_t mac[6];
+	uint8_t batch;              // send several packets per Dayna read
+	uint8_t delay;              // Dayna header delay in us, or LINK_DELAY_AUTO
+	uint8_t delay_min;          // lowest delay the automatic setting tries
+	uint8_t throttle;           // Dayna polls answered empty after a send
+	uint8_t allow_count;        // received protocols allowed, 0 for all
+	uint16_t allow[LINK_ALLOW_MAX];
+	uint16_t limit;             // broadcast/multicast packets/s, 0 for none
+	uint8_t burst;              // packets allowed at once over the limit
+	uint8_t xmit;               // ENC28J60 transmit buffers, 1 or 2
 } ENETConfig;
 extern ENETConfig config_enet;
 
@@ -86,7 +99,9 @@ extern ENETConfig config_enet;
 typedef enum {
 	HDD_MODE_NORMAL,            // access is always through FAT
 	HDD_MODE_FAST,              // low-level access if file contiguous
-	HDD_MODE_FORCEFAST          // always low-level access (dangerous!)
+	HDD_MODE_FORCEFAST,         // always low-level access (dangerous!)
+	HDD_MODE_RAW,               // no file, maps a card partition or LBA range
+	HDD_MODE_SPARSE             // file is a sparse image, allocated as used
 } HDDMODE;
 
 /*
@@ -101,9 +116,48 @@ typedef struct HDDConfig_t {
 	uint32_t size;              // size of HDD in sectors
 	FIL fp;
 	HDDMODE mode;
+	uint8_t part;               // if !=0, MBR partition for raw volumes
+	uint8_t chunk;              // log2 of chunk sectors for sparse images
 } HDDConfig;
 extern HDDConfig config_hdd[HARD_DRIVE_COUNT];
 
+/*
+ * The number of drives that may have a copy-on-write overlay, which sends all
+ * writes to a separate delta file and leaves the drive image untouched. This
+ * is normally set by the memory profile in the Makefile.
+ */
+#ifndef HDD_OVERLAY_COUNT
+	#define HDD_OVERLAY_COUNT   1
+#endif
+
+/*
+ * The number of bytes of each overlay's summary bitmap kept in SRAM. Each byte
+ * covers 32768 drive sectors (16MB); lookups past that read the header from
+ * the delta file instead.
+ */
+#ifndef HDD_OVERLAY_SUMMARY
+	#define HDD_OVERLAY_SUMMARY 16
+#endif
+
+/*
+ * The number of sparse image table entries kept in SRAM, shared by all drives.
+ * Must be a power of two no larger than the 128 entries in a table sector.
+ */
+#ifndef HDD_SPARSE_CACHE
+	#define HDD_SPARSE_CACHE    16
+#endif
+
+/*
+ * The overlay configuration information.
+ */
+typedef struct HDDOverlay_t {
+	uint8_t hdd;                // index into config_hdd, unused when 255
+	char filename[HDD_FILENAME_SIZE];
+	FIL fp;
+	uint8_t summary[HDD_OVERLAY_SUMMARY]; // start of the header summary
+} HDDOverlay;
+extern HDDOverlay config_overlay[HDD_OVERLAY_COUNT];
+
 /*
  * ============================================================================
  *   GLOBAL BUFFER
@@ -113,9 +167,73 @@ extern HDDConfig config_hdd[HARD_DRIVE_COUNT];
  * another part of the program executing when access to the memory card is not
  * being performed.
  */
-#define GLOBAL_BUFFER_SIZE      1032 // must be at least 516 * 2
+#ifndef GLOBAL_BUFFER_SIZE
+	#define GLOBAL_BUFFER_SIZE  1032 // must be at least GLOBAL_BUFFER_DISK
+#endif
 extern uint8_t global_buffer[GLOBAL_BUFFER_SIZE];
 
+/*
+ * The memory card code uses the start of the buffer as two chunks, each
+ * holding a sector plus its token and CRC. Larger profiles use the space
+ * after that for a VERIFY block and then PRE-FETCH sectors (see hdd.c).
+ */
+#define GLOBAL_BUFFER_CHUNK     516
+#define GLOBAL_BUFFER_DISK      (GLOBAL_BUFFER_CHUNK * 2)
+
+/*
+ * ============================================================================
+ *   MEMORY PROFILE CHECKS
+ * ============================================================================
+ * 
+ * The Makefile picks the sizes above (and the FatFs sector cache and exFAT
+ * support) based on the MCU. These checks make sure the chosen values are
+ * sane and catch profiles that clearly cannot fit. The per-item costs are
+ * estimates, and everything not listed (networking, statistics and the like)
+ * is lumped into the reserve, so the Makefile also checks the linked image
+ * against the MCU SRAM and a minimum stack.
+ */
+#define PROFILE_SRAM_PER_DRIVE  96   // HDDConfig, including the FIL
+#define PROFILE_SRAM_OVERLAY    (72 + HDD_OVERLAY_SUMMARY) // HDDOverlay
+#define PROFILE_SRAM_SPARSE     (8 + HDD_SPARSE_CACHE * 4) // table cache
+#define PROFILE_SRAM_EXFAT      1152 // LFN and exFAT directory buffers
+#define PROFILE_SRAM_TOOLBOX    448  // toolbox file index and open files
+#define PROFILE_SRAM_RESERVED   2048 // FATFS, networking, and the stack
+
+#if defined(USE_EXFAT)
+	#define PROFILE_SRAM_FS     PROFILE_SRAM_EXFAT
+#else
+	#define PROFILE_SRAM_FS     0
+#endif
+#if defined(USE_TOOLBOX)
+	#define PROFILE_SRAM_TB     PROFILE_SRAM_TOOLBOX
+#else
+	#define PROFILE_SRAM_TB     0
+#endif
+
+#if GLOBAL_BUFFER_SIZE < GLOBAL_BUFFER_DISK
+	#error "GLOBAL_BUFFER_SIZE must be at least GLOBAL_BUFFER_DISK"
+#endif
+#if HARD_DRIVE_COUNT < 1 || HARD_DRIVE_COUNT > 7
+	#error "HARD_DRIVE_COUNT must be between 1 and 7"
+#endif
+#if HDD_OVERLAY_COUNT < 1 || HDD_OVERLAY_COUNT > HARD_DRIVE_COUNT
+	#error "HDD_OVERLAY_COUNT must be between 1 and HARD_DRIVE_COUNT"
+#endif
+#if HDD_OVERLAY_SUMMARY < 1 || HDD_OVERLAY_SUMMARY > 504
+	#error "HDD_OVERLAY_SUMMARY must be between 1 and 504"
+#endif
+#if HDD_SPARSE_CACHE < 1 || HDD_SPARSE_CACHE > 128 \
+		|| (HDD_SPARSE_CACHE & (HDD_SPARSE_CACHE - 1))
+	#error "HDD_SPARSE_CACHE must be a power of two between 1 and 128"
+#endif
+#if (GLOBAL_BUFFER_SIZE + FF_WIN_CACHE * FF_MAX_SS \
+		+ HARD_DRIVE_COUNT * PROFILE_SRAM_PER_DRIVE \
+		+ HDD_OVERLAY_COUNT * PROFILE_SRAM_OVERLAY + PROFILE_SRAM_SPARSE \
+		+ PROFILE_SRAM_FS + PROFILE_SRAM_TB \
+		+ PROFILE_SRAM_RESERVED) > INTERNAL_SRAM_SIZE
+	#error "The memory profile does not fit in this MCU's SRAM"
+#endif
+
 /*
  * ============================================================================
  *   HARDWARE CONFIGURATION
@@ -306,6 +424,9 @@ extern uint8_t global_buffer[GLOBAL_BUFFER_SIZE];
  * variables. This returns the logical OR of the target masks in the provided
  * pointer.
  * 
+ * The parsed values are cached in EEPROM. If the size and timestamp of the
+ * file match what was cached the parser is skipped entirely.
+ * 
  * If there is a problem reading the configuration, this will directly invoke
  * fatal() with appropriate messages. The volume must be mounted before this is
  * invoked!
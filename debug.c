@@ -61,6 +61,17 @@ void debug_init(void)
 #endif
 
 	LED_PORT.OUT &= ~LED_PIN;
+
+	// free-running RTC from the 1.024kHz internal RC tap, for timing startup
+	CLK.RTCCTRL = CLK_RTCSRC_RCOSC_gc | CLK_RTCEN_bm;
+	while (RTC.STATUS & RTC_SYNCBUSY_bm);
+	RTC.PER = 0xFFFF;
+	RTC.CTRL = RTC_PRESCALER_DIV1_gc;
+}
+
+uint16_t debug_uptime(void)
+{
+	return RTC.CNT;
 }
 
 uint16_t debug_stack_unused(void)
@@ -31,6 +31,8 @@
  * for each symbol.
  */
 #define DEBUG_MAIN_ACTIVE_NO_TARGET               0x10 // 1
+#define DEBUG_MAIN_FIRST_SELECTION                0x11 // 2
+#define DEBUG_CONFIG_CACHE_USED                   0x1C // 0
 #define DEBUG_MAIN_STACK_UNUSED                   0x1D // 2
 #define DEBUG_MAIN_RESET                          0x1E // 0
 #define DEBUG_MAIN_READY                          0x1F // 0
@@ -49,6 +51,11 @@
 #define DEBUG_HDD_READ_OKAY                       0x81 // 0
 #define DEBUG_HDD_WRITE_STARTING                  0x82 // 0
 #define DEBUG_HDD_WRITE_OKAY                      0x83 // 0
+#define DEBUG_HDD_OVERLAY_DISCARD                 0x84 // 1
+#define DEBUG_HDD_SWAP                            0x85 // 1
+#define DEBUG_HDD_SWAP_FAILED                     0x86 // 2
+#define DEBUG_HDD_MISCOMPARE                      0x87 // 0
+#define DEBUG_HDD_PREFETCH                        0x88 // 0
 #define DEBUG_HDD_SEEK                            0x8C // 0
 #define DEBUG_HDD_NOT_READY                       0x90 // 0
 #define DEBUG_HDD_MEM_SEEK_ERROR                  0x91 // 1
@@ -62,6 +69,10 @@
 #define DEBUG_HDD_CHECK_FORCED                    0x99 // 1
 #define DEBUG_HDD_LBA                             0x9A // 4
 #define DEBUG_HDD_LENGTH                          0x9B // 2
+#define DEBUG_HDD_CREATE_STARTED                  0x9C // 1
+#define DEBUG_HDD_CREATE_DONE                     0x9D // 1
+#define DEBUG_HDD_CREATE_FAILED                   0x9E // 2
+#define DEBUG_HDD_READY                           0x9F // 3
 #define DEBUG_LINK_TX_REQUESTED                   0xA0 // 0
 #define DEBUG_LINK_SHORT_TX_START                 0xA4 // 0
 #define DEBUG_LINK_SHORT_TX_DONE                  0xA5 // 0
@@ -78,6 +89,8 @@
 #define DEBUG_LINK_RX_PACKET_START                0xB4 // 0
 #define DEBUG_LINK_RX_PACKET_DONE                 0xB6 // 0
 #define DEBUG_LINK_RX_PACKET_TRUNCATED            0xB8 // 1
+#define DEBUG_LINK_DELAY_CALIBRATED               0xB9 // 1
+#define DEBUG_LINK_RX_FILTERED                    0xBA // 0
 #define DEBUG_LINK_RX_ENDING                      0xBF // 0
 #define DEBUG_NET_TX_TIMEOUT_RETRANSMIT           0xC0 // 0
 #define DEBUG_NET_TX_ERROR_RETRANSMIT             0xC1 // 0
@@ -99,13 +112,14 @@
 #define DEBUG_FATAL                               0xEF // 2
 
 /*
- * Fatal error codes. Codes 1-4 are reserved for the hard drive devices. This
- * first batch are the long flash codes.
+ * Fatal error codes. Codes 1-7 are reserved for the hard drive devices, enough
+ * for the most drives any build supports, so the codes below mean the same
+ * thing on every MCU. This first batch are the long flash codes.
  */
-#define FATAL_CONFIG_FILE                         5
-#define FATAL_CONFIG_LINE_READ                    6
-#define FATAL_GENERAL                             7
-#define FATAL_MEM_MOUNT_FAILED                    8
+#define FATAL_CONFIG_FILE                         8
+#define FATAL_CONFIG_LINE_READ                    9
+#define FATAL_GENERAL                             10
+#define FATAL_MEM_MOUNT_FAILED                    11
 // short codes
 #define FATAL_BROWNOUT                            2
 #define FATAL_STACK_CORRUPTED                     3
@@ -164,6 +178,15 @@ static inline __attribute__((always_inline)) void debug(
  */
 void debug_init(void);
 
+/*
+ * Provides the time since debug_init() was called, in 1/1024 second units,
+ * wrapping after about 64 seconds. Besides startup timing measurements, this
+ * is the clock the network link uses for rate limiting and Dayna calibration,
+ * so the RTC must be running in every build, not only when debugging; users
+ * must take care to act before intervals approach the wrap.
+ */
+uint16_t debug_uptime(void);
+
 /*
  * Calculates the amount of stack space not yet used, using the "painting" done
  * during startup. This method is not foolproof but should give a good idea of
@@ -91,8 +91,8 @@
 static volatile uint8_t card_status = STA_NOINIT;
 static uint8_t card_type;
 
-// we treat the global buffer as two chunks of this size
-#define BUFFER_CHUNK        516
+// we treat the start of the global buffer as two chunks of this size
+#define BUFFER_CHUNK        GLOBAL_BUFFER_CHUNK
 
 // for all DMA channels, writing this to CTRLA starts them in the correct mode
 // and avoids the extra cycles of a read-modify-write in an atomic block
@@ -18,6 +18,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <util/delay.h>
 #include "lib/ff/ff.h"
 #include "lib/ff/diskio.h"
@@ -40,8 +41,53 @@ static const __flash uint8_t inquiry_data[] = {
 	'0', '.', '1', 'a'
 };
 
-// track global state of the whole subsystem
-static HDDSTATE state = HDD_NOINIT;
+// track the state of each virtual hard drive
+static HDDSTATE state[HARD_DRIVE_COUNT];
+
+// drives with image files waiting to be opened by hdd_open_check(), and the
+// drive that is currently having its image created, if any
+static uint8_t open_pending = 0;
+static uint8_t create_id = 255;
+
+// drives that need to go through hdd_contiguous_check(), and drives that
+// should report UNIT ATTENTION on their next command after an image swap
+static uint8_t check_pending = 0;
+static uint8_t attention = 0;
+
+// largest image hdd_open_check() will create, in MB, so the last LBA still
+// fits in the 32 bits READ CAPACITY has for it
+#define HDD_MAX_CREATE_SIZE 0x1FFFFF
+
+// the FIL the image being created is written through, either the drive's own
+// or that of its overlay
+static FIL* create_fp;
+
+// VERIFY compares whole blocks from the initiator against card data when there
+// is room for them past the card read buffers, or smaller pieces otherwise
+#if GLOBAL_BUFFER_SIZE >= GLOBAL_BUFFER_DISK + 512
+	#define VERIFY_BUFFER (global_buffer + GLOBAL_BUFFER_DISK)
+#else
+	#define VERIFY_CHUNK 64
+#endif
+
+// byte offset reached by the current VERIFY, and whether it hit a difference
+static uint32_t verify_offset;
+static uint8_t verify_miscompare;
+
+// sectors loaded ahead of a READ after a SEEK or PRE-FETCH are kept past the
+// VERIFY buffer when there is room; otherwise only the FAT lookup is warmed
+#if GLOBAL_BUFFER_SIZE >= GLOBAL_BUFFER_DISK + 512 * 2
+	#define PREFETCH_BUFFER (global_buffer + GLOBAL_BUFFER_DISK + 512)
+	#define PREFETCH_MAX ((GLOBAL_BUFFER_SIZE - GLOBAL_BUFFER_DISK - 512) / 512)
+#endif
+
+// drive and range of the last SEEK or PRE-FETCH, whether it still needs to be
+// acted on, and how many sectors from it are in the buffer
+static uint8_t prefetch_id = 255;
+static uint32_t prefetch_lba;
+static uint16_t prefetch_length;
+static uint8_t prefetch_pending = 0;
+static uint8_t prefetch_count = 0;
 
 // generic buffer for READ/WRITE BUFFER commands
 #define MEMORY_BUFFER_OFFSET 600 // from front of global buffer
@@ -72,27 +118,44 @@ static void hdd_update_capacity(uint8_t id, uint8_t* arr)
 }
 
 /*
- * Seeks to the correct position within a filesystem-backed virtual hard drive
- * unit. This should not be invoked on raw volumes.
- * 
- * Returns true on success and false on failure.
+ * Reads or writes a single sector of a file, for the metadata kept in overlay
+ * and sparse image files. These are small enough that the regular FatFs calls
+ * are fine.
  */
-static uint8_t hdd_seek(uint8_t id, uint32_t lba)
+static FRESULT hdd_file_io(FIL* fp, uint32_t sector,
+		uint8_t* buf, uint8_t write)
 {
-	FRESULT res = f_lseek(&(config_hdd[id].fp), lba * 512);
-	if (res)
+	UINT act;
+	FRESULT res = f_lseek(fp, (FSIZE_t) sector * 512);
+	if (res) return res;
+	if (write)
 	{
-		debug_dual(DEBUG_HDD_MEM_SEEK_ERROR, res);
-		state = HDD_ERROR;
-		logic_set_sense(SENSE_MEDIUM_ERROR, 0);
-		logic_status(LOGIC_STATUS_CHECK_CONDITION);
-		logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
-		return 0;
+		res = f_write(fp, buf, 512, &act);
 	}
 	else
 	{
-		return 1;
+		res = f_read(fp, buf, 512, &act);
 	}
+	if (! res && act != 512) res = FR_DISK_ERR;
+	return res;
+}
+
+/*
+ * Little-endian 32-bit value access, for the on-card structures.
+ */
+static uint32_t hdd_le32_get(uint8_t* p)
+{
+	return ((uint32_t) p[3] << 24)
+			| ((uint32_t) p[2] << 16)
+			| ((uint32_t) p[1] << 8)
+			| p[0];
+}
+static void hdd_le32_put(uint8_t* p, uint32_t v)
+{
+	p[0] = (uint8_t) v;
+	p[1] = (uint8_t) (v >> 8);
+	p[2] = (uint8_t) (v >> 16);
+	p[3] = (uint8_t) (v >> 24);
 }
 
 /*
@@ -146,6 +209,902 @@ static uint8_t hdd_parse_op(uint8_t id, uint8_t* cmd,
 	}
 }
 
+/*
+ * ============================================================================
+ *   SPARSE IMAGES
+ * ============================================================================
+ * 
+ * Sparse images only store the parts of the drive that have been written to,
+ * in fixed-size chunks that are appended to the file as they are first used.
+ * The file is laid out in sectors as:
+ * 
+ * 0:            header, with a magic value, the drive size in sectors (LE32)
+ *               and the log2 of the chunk size in sectors;
+ * 1 to B:       block allocation table, with a LE32 entry per chunk giving
+ *               its position in the data area (1 being the first), or 0 if
+ *               the chunk has not been allocated;
+ * B+1 onward:   data area, in chunk order of allocation.
+ * 
+ * Unallocated chunks read back as zeroes. The chunk size is picked when the
+ * image is created to keep the table to a reasonable size.
+ */
+#define SPARSE_MIN_SHIFT        6    // 32KB chunks
+#define SPARSE_NEW_SHIFT        8    // largest chunks for new images
+#define SPARSE_MAX_SHIFT        15   // largest chunks accepted when opening
+#define SPARSE_MAX_TABLE        1024 // table sectors, before chunks grow
+#define SPARSE_TABLE            (global_buffer)
+#define SPARSE_ZERO             (global_buffer + 516)
+static const __flash uint8_t sparse_magic[8] = {
+	's', 'c', 'u', 'z', 's', 'p', 'r', '1'
+};
+
+/*
+ * Window of table entries most recently looked up, so runs of commands in the
+ * same area of the drive do not read the table from the card each time. The
+ * window is aligned to its own size within a table sector.
+ */
+static uint32_t sparse_cache[HDD_SPARSE_CACHE];
+static uint32_t sparse_cache_first;
+static uint8_t sparse_cache_id = 255;
+
+/*
+ * Source of sectors for f_mwrite() when laying out sparse images. Sectors in
+ * the fill range are taken from the given block function, sector 0 gets a
+ * header if a size for one has been given, and everything else is zeroed.
+ */
+static uint8_t (*sparse_fill_func)(uint8_t*);
+static uint32_t sparse_fill_pos;
+static uint16_t sparse_fill_start;
+static uint16_t sparse_fill_end;
+static uint32_t sparse_fill_header;
+static uint8_t sparse_fill_shift;
+static uint8_t hdd_sparse_fill(uint8_t* buf)
+{
+	uint8_t res = 1;
+	if (sparse_fill_pos >= sparse_fill_start && sparse_fill_pos < sparse_fill_end)
+	{
+		res = sparse_fill_func(buf);
+	}
+	else
+	{
+		memset(buf, 0, 512);
+		if (sparse_fill_pos == 0 && sparse_fill_header > 0)
+		{
+			for (uint8_t i = 0; i < sizeof(sparse_magic); i++)
+			{
+				buf[i] = sparse_magic[i];
+			}
+			hdd_le32_put(buf + 8, sparse_fill_header);
+			buf[12] = sparse_fill_shift;
+		}
+	}
+	sparse_fill_pos++;
+	return res;
+}
+
+/*
+ * Provides the number of table sectors needed for the given drive size and
+ * chunk size.
+ */
+static uint32_t hdd_sparse_table(uint32_t size, uint8_t shift)
+{
+	uint32_t chunks = ((size - 1) >> shift) + 1;
+	return (chunks + 127) >> 7;
+}
+
+/*
+ * Provides the file sector the data area of the drive's image starts at.
+ */
+static uint32_t hdd_sparse_data(uint8_t id)
+{
+	return 1 + hdd_sparse_table(config_hdd[id].size, config_hdd[id].chunk);
+}
+
+/*
+ * Writes the header and an empty table into a freshly opened, empty file. The
+ * table grows past SPARSE_MAX_TABLE for very large drives rather than the
+ * chunks growing past SPARSE_NEW_SHIFT, since the first write to a chunk has
+ * to zero all of it within a single command.
+ */
+static FRESULT hdd_sparse_create(FIL* fp, uint32_t size)
+{
+	uint8_t shift = SPARSE_MIN_SHIFT;
+	while (hdd_sparse_table(size, shift) > SPARSE_MAX_TABLE
+			&& shift < SPARSE_NEW_SHIFT) shift++;
+
+	UINT act;
+	UINT count = 1 + hdd_sparse_table(size, shift);
+
+	// creating the file left the directory dirty, f_mwrite() needs it clean
+	FRESULT res = f_sync(fp);
+	if (res) return res;
+
+	sparse_fill_pos = 0;
+	sparse_fill_start = 0;
+	sparse_fill_end = 0;
+	sparse_fill_header = size;
+	sparse_fill_shift = shift;
+	res = f_mwrite(fp, hdd_sparse_fill, count, &act);
+	sparse_fill_header = 0;
+	if (res) return res;
+	if (act != count) return FR_DENIED;
+	return f_sync(fp);
+}
+
+/*
+ * Checks the header of an open sparse image, setting up the drive size and
+ * chunk size from it.
+ */
+static FRESULT hdd_sparse_open(uint8_t id)
+{
+	FIL* fp = &(config_hdd[id].fp);
+	if (sparse_cache_id == id) sparse_cache_id = 255;
+	FRESULT res = hdd_file_io(fp, 0, SPARSE_TABLE, 0);
+	if (res) return res;
+
+	for (uint8_t i = 0; i < sizeof(sparse_magic); i++)
+	{
+		if (SPARSE_TABLE[i] != sparse_magic[i]) return FR_INVALID_OBJECT;
+	}
+	config_hdd[id].size = hdd_le32_get(SPARSE_TABLE + 8);
+	config_hdd[id].chunk = SPARSE_TABLE[12];
+	if (config_hdd[id].size == 0
+			|| config_hdd[id].chunk < SPARSE_MIN_SHIFT
+			|| config_hdd[id].chunk > SPARSE_MAX_SHIFT
+			|| f_size(fp) < (FSIZE_t) hdd_sparse_data(id) * 512)
+	{
+		return FR_INVALID_OBJECT;
+	}
+	return FR_OK;
+}
+
+/*
+ * Loads the window of table entries holding the given chunk into the cache,
+ * if it is not there already.
+ */
+static FRESULT hdd_sparse_load(uint8_t id, uint32_t chunk)
+{
+	uint32_t first = chunk & ~((uint32_t) HDD_SPARSE_CACHE - 1);
+	if (sparse_cache_id == id && sparse_cache_first == first) return FR_OK;
+
+	sparse_cache_id = 255;
+	FRESULT res = hdd_file_io(&(config_hdd[id].fp), 1 + (chunk >> 7),
+			SPARSE_TABLE, 0);
+	if (res) return res;
+
+	uint8_t* p = SPARSE_TABLE + ((first & 127) << 2);
+	for (uint8_t i = 0; i < HDD_SPARSE_CACHE; i++, p += 4)
+	{
+		sparse_cache[i] = hdd_le32_get(p);
+	}
+	sparse_cache_id = id;
+	sparse_cache_first = first;
+	return FR_OK;
+}
+
+/*
+ * Finds how many sectors starting at the given LBA can be handled together,
+ * up to the given maximum: either a run of unallocated chunks, or chunks that
+ * follow each other in the data area. The file sector the run starts at is
+ * stored in 'sect', or 0 if the run is unallocated.
+ */
+static FRESULT hdd_sparse_run(uint8_t id, uint32_t lba, uint16_t max,
+		uint16_t* run, uint32_t* sect)
+{
+	uint8_t shift = config_hdd[id].chunk;
+	uint32_t chunk = lba >> shift;
+	uint8_t idx = chunk & (HDD_SPARSE_CACHE - 1);
+
+	FRESULT res = hdd_sparse_load(id, chunk);
+	if (res) return res;
+
+	uint32_t first = sparse_cache[idx];
+	uint32_t offset = lba & ((1UL << shift) - 1);
+	uint32_t n = (1UL << shift) - offset;
+	for (uint8_t i = 1; n < max && idx + i < HDD_SPARSE_CACHE; i++)
+	{
+		uint32_t e = sparse_cache[idx + i];
+		if (e != (first ? first + i : 0)) break;
+		n += (1UL << shift);
+	}
+
+	*run = (n > max) ? max : n;
+	*sect = 0;
+	if (first)
+	{
+		*sect = hdd_sparse_data(id) + ((first - 1) << shift) + offset;
+	}
+	return FR_OK;
+}
+
+/*
+ * Reads sectors from a sparse image, passing each to the given block function.
+ * Each run of allocated chunks is read with one multi-sector read, and
+ * unallocated chunks are passed as zeroes without touching the card.
+ */
+static uint8_t hdd_sparse_read(uint8_t id, uint32_t lba, uint16_t length,
+		uint8_t (*func)(uint8_t*), uint16_t* act_len)
+{
+	FIL* fp = &(config_hdd[id].fp);
+	uint16_t run;
+	UINT act;
+	uint32_t sect;
+	uint8_t res;
+
+	while (length > 0)
+	{
+		res = hdd_sparse_run(id, lba, length, &run, &sect);
+		if (res) return res;
+
+		act = 0;
+		if (sect == 0)
+		{
+			memset(SPARSE_ZERO, 0, 512);
+			while (act < run && func(SPARSE_ZERO)) act++;
+		}
+		else
+		{
+			res = f_lseek(fp, (FSIZE_t) sect * 512);
+			if (! res) res = f_mread(fp, func, run, &act, 0);
+		}
+		*act_len += act;
+		if (res) return res;
+		if (act != run) return FR_DISK_ERR;
+
+		lba += run;
+		length -= run;
+	}
+	return 0;
+}
+
+/*
+ * Writes sectors from the given block function into a sparse image. Writes to
+ * an unallocated chunk append a new chunk to the file, zeroing whatever part
+ * of it the write does not cover, before the table entry is updated.
+ */
+static uint8_t hdd_sparse_write(uint8_t id, uint32_t lba, uint16_t length,
+		uint8_t (*func)(uint8_t*), uint16_t* act_len)
+{
+	FIL* fp = &(config_hdd[id].fp);
+	uint8_t shift = config_hdd[id].chunk;
+	uint16_t run;
+	UINT act;
+	uint32_t sect;
+	uint8_t res;
+
+	while (length > 0)
+	{
+		res = hdd_sparse_run(id, lba, length, &run, &sect);
+		if (res) return res;
+
+		if (sect > 0)
+		{
+			act = 0;
+			res = f_lseek(fp, (FSIZE_t) sect * 512);
+			if (! res) res = f_mwrite(fp, func, run, &act);
+			*act_len += act;
+			if (res) return res;
+			if (act != run) return FR_DISK_ERR;
+		}
+		else
+		{
+			// one chunk at a time; any partial chunk left over from an
+			// interrupted allocation is skipped
+			uint32_t offset = lba & ((1UL << shift) - 1);
+			if (run > (1UL << shift) - offset) run = (1UL << shift) - offset;
+			uint32_t data = hdd_sparse_data(id);
+			uint32_t used = (uint32_t) (f_size(fp) >> 9) - data;
+			uint32_t entry = ((used + (1UL << shift) - 1) >> shift) + 1;
+
+			// extending the file here may leave the FAT dirty, which
+			// f_mwrite() will not accept
+			res = f_lseek(fp, (FSIZE_t) (data + ((entry - 1) << shift)) * 512);
+			if (! res) res = f_sync(fp);
+			if (res) return res;
+
+			sparse_fill_func = func;
+			sparse_fill_pos = 0;
+			sparse_fill_start = offset;
+			sparse_fill_end = offset + run;
+			res = f_mwrite(fp, hdd_sparse_fill, 1U << shift, &act);
+			if (res) return res;
+			if (act != (1U << shift)) return FR_DISK_ERR;
+			*act_len += run;
+
+			uint32_t chunk = lba >> shift;
+			sparse_cache_id = 255;
+			res = hdd_file_io(fp, 1 + (chunk >> 7), SPARSE_TABLE, 0);
+			if (! res)
+			{
+				hdd_le32_put(SPARSE_TABLE + ((chunk & 127) << 2), entry);
+				res = hdd_file_io(fp, 1 + (chunk >> 7), SPARSE_TABLE, 1);
+			}
+			if (! res) res = f_sync(fp);
+			if (res) return res;
+		}
+
+		lba += run;
+		length -= run;
+	}
+	return 0;
+}
+
+/*
+ * Opens the given image file for the drive, setting the drive size from it.
+ */
+static FRESULT hdd_open_image(uint8_t id, const char* path, BYTE mode)
+{
+	FIL* fp = &(config_hdd[id].fp);
+	FRESULT res = f_open(fp, path, mode);
+	if (res) return res;
+
+	if (config_hdd[id].mode == HDD_MODE_SPARSE)
+	{
+		res = hdd_sparse_open(id);
+	}
+	else
+	{
+		// store in 512 byte sectors
+		config_hdd[id].size = (f_size(fp) >> 9);
+		if (config_hdd[id].size == 0) res = FR_INVALID_OBJECT;
+	}
+	if (res) f_close(fp);
+	return res;
+}
+
+/*
+ * ============================================================================
+ *   COPY-ON-WRITE OVERLAYS
+ * ============================================================================
+ * 
+ * A drive with an overlay treats its image as read-only, and all writes go to
+ * a separate delta file instead. The delta file is laid out in sectors as:
+ * 
+ * 0:            header, with a magic value followed by a summary bitmap that
+ *               has one bit for each bitmap sector below;
+ * 1 to B:       bitmap, one bit per drive sector, set when that sector has
+ *               been written to the delta file;
+ * B+1 onward:   drive sector N is kept at delta sector B+1+N.
+ * 
+ * Bitmap sectors with a clear summary bit are treated as all zeroes, so the
+ * whole overlay can be discarded by rewriting just the header. The start of
+ * the summary is also kept in HDDOverlay, so lookups in spans that were never
+ * written do not touch the card. When the header or a bitmap sector must be
+ * read, they are staged in the two chunks of the card double buffer at the
+ * start of the global buffer, which the multi-sector calls the overlay code
+ * makes between lookups are free to overwrite.
+ */
+#define OVERLAY_SPAN            4096 // drive sectors per bitmap sector
+#define OVERLAY_SUMMARY         8    // offset of summary bits within header
+#define OVERLAY_MAX_SECTORS     ((uint32_t) (512 - OVERLAY_SUMMARY) * 8 \
+		* OVERLAY_SPAN)
+#define OVERLAY_HEADER          (global_buffer)
+#define OVERLAY_MAP             (global_buffer + 516)
+static const __flash uint8_t overlay_magic[OVERLAY_SUMMARY] = {
+	's', 'c', 'u', 'z', 'o', 'v', 'l', '1'
+};
+
+/*
+ * Provides the overlay for the given drive, or NULL if it does not have one.
+ */
+static HDDOverlay* hdd_overlay(uint8_t id)
+{
+	for (uint8_t i = 0; i < HDD_OVERLAY_COUNT; i++)
+	{
+		if (config_overlay[i].hdd == id) return &(config_overlay[i]);
+	}
+	return NULL;
+}
+
+/*
+ * Provides the delta file sector holding the first drive sector, which is
+ * also the number of header and bitmap sectors in front of it.
+ */
+static uint32_t hdd_overlay_data(uint8_t id)
+{
+	return 1 + (config_hdd[id].size + OVERLAY_SPAN - 1) / OVERLAY_SPAN;
+}
+
+/*
+ * Copies the start of the summary bitmap from a header that was just read or
+ * written into SRAM.
+ */
+static void hdd_overlay_keep(HDDOverlay* ov)
+{
+	memcpy(ov->summary, &(OVERLAY_HEADER[OVERLAY_SUMMARY]),
+			HDD_OVERLAY_SUMMARY);
+}
+
+/*
+ * Provides the summary bit for the given bitmap sector, reading the header
+ * only if that part of the summary is not kept in SRAM.
+ */
+static FRESULT hdd_overlay_used(HDDOverlay* ov, uint16_t blk, uint8_t* used)
+{
+	if ((blk >> 3) < HDD_OVERLAY_SUMMARY)
+	{
+		*used = ov->summary[blk >> 3] & _BV(blk & 7);
+		return FR_OK;
+	}
+
+	FRESULT res = hdd_file_io(&(ov->fp), 0, OVERLAY_HEADER, 0);
+	if (res) return res;
+	*used = OVERLAY_HEADER[OVERLAY_SUMMARY + (blk >> 3)] & _BV(blk & 7);
+	return FR_OK;
+}
+
+/*
+ * Clears the overlay, dropping every sector written to it so far.
+ */
+static FRESULT hdd_overlay_reset(HDDOverlay* ov)
+{
+	memset(ov->summary, 0, HDD_OVERLAY_SUMMARY);
+	memset(OVERLAY_HEADER, 0, 512);
+	for (uint8_t i = 0; i < OVERLAY_SUMMARY; i++)
+	{
+		OVERLAY_HEADER[i] = overlay_magic[i];
+	}
+	FRESULT res = hdd_file_io(&(ov->fp), 0, OVERLAY_HEADER, 1);
+	if (! res) res = f_sync(&(ov->fp));
+	return res;
+}
+
+/*
+ * Checks that an open delta file is large enough for its drive. If the header
+ * is not valid, or if 'reset' is true, the overlay is cleared.
+ */
+static FRESULT hdd_overlay_check(uint8_t id, HDDOverlay* ov, uint8_t reset)
+{
+	uint32_t need = hdd_overlay_data(id) + config_hdd[id].size;
+	if (f_size(&(ov->fp)) < (FSIZE_t) need * 512) return FR_INVALID_OBJECT;
+
+	if (! reset)
+	{
+		FRESULT res = hdd_file_io(&(ov->fp), 0, OVERLAY_HEADER, 0);
+		if (res) return res;
+		for (uint8_t i = 0; i < OVERLAY_SUMMARY; i++)
+		{
+			if (OVERLAY_HEADER[i] != overlay_magic[i]) reset = 1;
+		}
+		if (! reset)
+		{
+			hdd_overlay_keep(ov);
+			return FR_OK;
+		}
+	}
+	return hdd_overlay_reset(ov);
+}
+
+/*
+ * Finds how many sectors starting at the given LBA share the same state, up
+ * to the given maximum and the end of the bitmap sector. The state is stored
+ * in 'dirty', which is true if the run needs to come from the delta file.
+ */
+static FRESULT hdd_overlay_run(HDDOverlay* ov, uint32_t lba, uint16_t max,
+		uint16_t* run, uint8_t* dirty)
+{
+	uint16_t blk = lba / OVERLAY_SPAN;
+	uint16_t bit = lba % OVERLAY_SPAN;
+	uint16_t lim = OVERLAY_SPAN - bit;
+	if (lim > max) lim = max;
+
+	uint8_t used;
+	FRESULT res = hdd_overlay_used(ov, blk, &used);
+	if (res) return res;
+	if (! used)
+	{
+		// nothing in this span has been written yet
+		*dirty = 0;
+		*run = lim;
+		return FR_OK;
+	}
+
+	res = hdd_file_io(&(ov->fp), 1 + blk, OVERLAY_MAP, 0);
+	if (res) return res;
+	uint8_t d = (OVERLAY_MAP[bit >> 3] & _BV(bit & 7)) ? 1 : 0;
+	uint16_t n = 1;
+	for (bit++; n < lim; bit++, n++)
+	{
+		if (((OVERLAY_MAP[bit >> 3] & _BV(bit & 7)) ? 1 : 0) != d) break;
+	}
+	*dirty = d;
+	*run = n;
+	return FR_OK;
+}
+
+/*
+ * Marks the given sectors as written to the delta file. The range must not
+ * cross the end of a bitmap sector. The bitmap sector is written before the
+ * header, so a reset partway through can only lose the mark for sectors that
+ * were never acknowledged to the initiator.
+ */
+static FRESULT hdd_overlay_mark(HDDOverlay* ov, uint32_t lba, uint16_t count)
+{
+	uint16_t blk = lba / OVERLAY_SPAN;
+	uint16_t bit = lba % OVERLAY_SPAN;
+
+	uint8_t used;
+	FRESULT res = hdd_overlay_used(ov, blk, &used);
+	if (res) return res;
+	uint8_t fresh = ! used;
+
+	// an unused bitmap sector may hold leftovers from before a discard
+	if (fresh)
+	{
+		memset(OVERLAY_MAP, 0, 512);
+	}
+	else
+	{
+		res = hdd_file_io(&(ov->fp), 1 + blk, OVERLAY_MAP, 0);
+		if (res) return res;
+	}
+	for (; count > 0; count--, bit++)
+	{
+		OVERLAY_MAP[bit >> 3] |= _BV(bit & 7);
+	}
+	res = hdd_file_io(&(ov->fp), 1 + blk, OVERLAY_MAP, 1);
+	if (res) return res;
+
+	if (fresh)
+	{
+		res = hdd_file_io(&(ov->fp), 0, OVERLAY_HEADER, 0);
+		if (res) return res;
+		OVERLAY_HEADER[OVERLAY_SUMMARY + (blk >> 3)] |= _BV(blk & 7);
+		res = hdd_file_io(&(ov->fp), 0, OVERLAY_HEADER, 1);
+		if (! res) hdd_overlay_keep(ov);
+	}
+	return res;
+}
+
+/*
+ * Reads sectors through the overlay, passing each to the given block function.
+ * Each run of sectors in the same state is handled with one multi-sector read
+ * from either the delta file or the drive image.
+ */
+static uint8_t hdd_overlay_read(uint8_t id, HDDOverlay* ov, uint32_t lba,
+		uint16_t length, uint8_t (*func)(uint8_t*), uint16_t* act_len)
+{
+	uint32_t data = hdd_overlay_data(id);
+	uint16_t rem = length;
+	uint16_t run;
+	UINT act;
+	uint8_t dirty, res;
+
+	while (rem > 0)
+	{
+		res = hdd_overlay_run(ov, lba, rem, &run, &dirty);
+		if (res) return res;
+
+		act = 0;
+		if (dirty)
+		{
+			res = f_lseek(&(ov->fp), (FSIZE_t) (data + lba) * 512);
+			if (! res) res = f_mread(&(ov->fp), func, run, &act, 0);
+		}
+		else if (config_hdd[id].lba > 0) // low-level access
+		{
+			res = disk_read_multi(0, func, config_hdd[id].lba + lba, run);
+			if (! res) act = run;
+		}
+		else if (config_hdd[id].mode == HDD_MODE_SPARSE)
+		{
+			uint16_t sparse_act = 0;
+			res = hdd_sparse_read(id, lba, run, func, &sparse_act);
+			act = sparse_act;
+		}
+		else // access via FAT
+		{
+			res = f_lseek(&(config_hdd[id].fp), (FSIZE_t) lba * 512);
+			if (! res) res = f_mread(&(config_hdd[id].fp), func,
+					run, &act, 0);
+		}
+		*act_len += act;
+		if (res) return res;
+		if (act != run) return FR_DISK_ERR;
+
+		lba += run;
+		rem -= run;
+	}
+	return 0;
+}
+
+/*
+ * Writes the sectors of a WRITE operation into the delta file, taking each
+ * from the given block function and marking them in the bitmap after each
+ * slice has been stored.
+ */
+static uint8_t hdd_overlay_write(uint8_t id, HDDOverlay* ov, LogicDataOp* op,
+		uint8_t (*func)(uint8_t*), uint16_t* act_len)
+{
+	uint32_t data = hdd_overlay_data(id);
+	uint32_t lba = op->lba;
+	uint16_t rem = op->length;
+	uint16_t run;
+	UINT act;
+	uint8_t res;
+
+	while (rem > 0)
+	{
+		run = OVERLAY_SPAN - (lba % OVERLAY_SPAN);
+		if (run > rem) run = rem;
+
+		act = 0;
+		res = f_lseek(&(ov->fp), (FSIZE_t) (data + lba) * 512);
+		if (! res) res = f_mwrite(&(ov->fp), func, run, &act);
+		*act_len += act;
+		if (res) return res;
+		if (act != run) return FR_DISK_ERR;
+
+		res = hdd_overlay_mark(ov, lba, run);
+		if (res) return res;
+
+		lba += run;
+		rem -= run;
+	}
+	return 0;
+}
+
+/*
+ * ============================================================================
+ * 
+ *   PRE-FETCH
+ * 
+ * ============================================================================
+ * 
+ * SEEK and PRE-FETCH record the sectors the initiator is about to want, and
+ * hdd_prefetch_check() loads them into SRAM from the main loop while the bus is
+ * free. A READ that starts within them is answered from SRAM first. Only one
+ * range is held at a time, and anything written to any drive discards it.
+ */
+
+static void hdd_prefetch_forget(void)
+{
+	prefetch_id = 255;
+	prefetch_pending = 0;
+	prefetch_count = 0;
+}
+
+/*
+ * Records the given range to be loaded the next time the bus is free.
+ */
+static void hdd_prefetch_hint(uint8_t id, uint32_t lba, uint16_t length)
+{
+	prefetch_id = id;
+	prefetch_lba = lba;
+	prefetch_length = length;
+	prefetch_pending = 1;
+	prefetch_count = 0;
+}
+
+#ifdef PREFETCH_BUFFER
+/*
+ * Block function that stores sectors coming off the card in the buffer.
+ */
+static uint8_t hdd_prefetch_block(uint8_t* data)
+{
+	memcpy(PREFETCH_BUFFER + ((uint16_t) prefetch_count << 9), data, 512);
+	prefetch_count++;
+	return 1;
+}
+
+/*
+ * Sends the initiator whatever part of a READ starting at the given sector is
+ * already in the buffer. The number of sectors sent is added to the last
+ * parameter. Returns zero on success.
+ */
+static uint8_t hdd_prefetch_read(uint8_t id, uint32_t lba, uint16_t length,
+		uint16_t* act_len)
+{
+	if (id != prefetch_id || lba < prefetch_lba
+			|| lba >= prefetch_lba + prefetch_count)
+		return 0;
+
+	uint8_t i = (uint8_t) (lba - prefetch_lba);
+	while (i < prefetch_count && *act_len < length)
+	{
+		if (! phy_data_offer_block(PREFETCH_BUFFER + ((uint16_t) i << 9)))
+			return FR_DISK_ERR;
+		(*act_len)++;
+		i++;
+	}
+	return 0;
+}
+#else
+static uint8_t hdd_prefetch_read(uint8_t id, uint32_t lba, uint16_t length,
+		uint16_t* act_len)
+{
+	(void) id; // silence compiler warnings
+	(void) lba;
+	(void) length;
+	(void) act_len;
+	return 0;
+}
+#endif /* PREFETCH_BUFFER */
+
+/*
+ * ============================================================================
+ * 
+ *   DATA ACCESS
+ * 
+ * ============================================================================
+ * 
+ * These move sectors between the card and the bus for whatever kind of storage
+ * backs the drive. The number of sectors actually moved is provided through
+ * the last parameter, and the return value is zero on success or the FatFs (or
+ * disk) error code on failure.
+ */
+
+/*
+ * Reads the given sectors of the drive, passing each to the given block
+ * function as it comes off the card.
+ */
+static uint8_t hdd_read_data(uint8_t id, uint32_t lba, uint16_t length,
+		uint8_t (*func)(uint8_t*), uint16_t* act_len)
+{
+	uint8_t res;
+	HDDOverlay* ov = hdd_overlay(id);
+	if (ov != NULL) // copy-on-write overlay
+	{
+		res = hdd_overlay_read(id, ov, lba, length, func, act_len);
+	}
+	else if (config_hdd[id].mode == HDD_MODE_SPARSE)
+	{
+		res = hdd_sparse_read(id, lba, length, func, act_len);
+	}
+	else if (config_hdd[id].lba > 0) // low-level access
+	{
+		res = disk_read_multi(0, func, config_hdd[id].lba + lba, length);
+		if (! res) *act_len = length;
+	}
+	else // access via FAT
+	{
+		res = f_lseek(&(config_hdd[id].fp), (FSIZE_t) lba * 512);
+		if (! res) res = f_mread(&(config_hdd[id].fp), func,
+				length, act_len, 0);
+	}
+	return res;
+}
+
+/*
+ * Writes the sectors of the given operation to the drive, getting each from the
+ * given block function (normally the initiator) as the card is ready for it.
+ */
+static uint8_t hdd_write_data(uint8_t id, LogicDataOp* op,
+		uint8_t (*func)(uint8_t*), uint16_t* act_len)
+{
+	uint8_t res;
+	hdd_prefetch_forget();
+	HDDOverlay* ov = hdd_overlay(id);
+	if (ov != NULL) // copy-on-write overlay
+	{
+		res = hdd_overlay_write(id, ov, op, func, act_len);
+	}
+	else if (config_hdd[id].mode == HDD_MODE_SPARSE)
+	{
+		res = hdd_sparse_write(id, op->lba, op->length, func, act_len);
+	}
+	else if (config_hdd[id].lba > 0) // low-level access
+	{
+		uint32_t offset = config_hdd[id].lba + op->lba;
+		res = disk_write_multi(0, func, offset, op->length);
+		if (! res) *act_len = op->length;
+	}
+	else // access via FAT
+	{
+		res = f_lseek(&(config_hdd[id].fp), (FSIZE_t) op->lba * 512);
+		if (! res) res = f_mwrite(&(config_hdd[id].fp), func,
+				op->length, act_len);
+	}
+	return res;
+}
+
+/*
+ * Block function for VERIFY with BytChk set: asks the initiator for the next
+ * block and compares it against the block just read from the card. This stops
+ * the read at the first difference, flagging the miscompare.
+ */
+static uint8_t hdd_verify_block(uint8_t* data)
+{
+	uint16_t i = 0;
+#ifdef VERIFY_BUFFER
+	uint8_t* host = VERIFY_BUFFER;
+	if (! phy_data_ask_block(host)) return 0;
+	while (i < 512 && host[i] == data[i]) i++;
+#else
+	uint8_t host[VERIFY_CHUNK];
+	while (i < 512)
+	{
+		if (phy_data_ask_bulk(host, VERIFY_CHUNK) != VERIFY_CHUNK) return 0;
+		uint8_t j = 0;
+		while (j < VERIFY_CHUNK && host[j] == data[i + j]) j++;
+		i += j;
+		if (j < VERIFY_CHUNK) break;
+	}
+#endif
+
+	verify_offset += i;
+	if (i < 512)
+	{
+		verify_miscompare = 1;
+		return 0;
+	}
+	return 1;
+}
+
+#ifndef VERIFY_BUFFER
+/*
+ * Block function that accepts card data without doing anything with it, for
+ * checking that sectors can be read back.
+ */
+static uint8_t hdd_verify_discard(uint8_t* data)
+{
+	(void) data; // silence compiler warning
+	return 1;
+}
+#else
+/*
+ * Block function for WRITE AND VERIFY: asks the initiator for the next block
+ * and keeps a copy of it to compare against once it has been written.
+ */
+static uint8_t hdd_verify_keep(uint8_t* buf)
+{
+	if (! phy_data_ask_block(buf)) return 0;
+	memcpy(VERIFY_BUFFER, buf, 512);
+	return 1;
+}
+
+/*
+ * Block function that compares a block read back from the card against the
+ * copy kept by hdd_verify_keep(), flagging the miscompare.
+ */
+static uint8_t hdd_verify_match(uint8_t* data)
+{
+	uint16_t i = 0;
+	while (i < 512 && VERIFY_BUFFER[i] == data[i]) i++;
+
+	verify_offset += i;
+	if (i < 512)
+	{
+		verify_miscompare = 1;
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Writes the sectors of a WRITE AND VERIFY one at a time, reading each back
+ * and comparing it against the copy of what the initiator sent. A difference
+ * stops the write and is flagged in verify_miscompare.
+ */
+static uint8_t hdd_write_verify(uint8_t id, LogicDataOp* op,
+		uint16_t* act_len)
+{
+	LogicDataOp one;
+	uint16_t n;
+	uint8_t res;
+
+	verify_offset = 0;
+	verify_miscompare = 0;
+	one.length = 1;
+	for (uint16_t i = 0; i < op->length; i++)
+	{
+		one.lba = op->lba + i;
+		n = 0;
+		res = hdd_write_data(id, &one, hdd_verify_keep, &n);
+		if (res) return res;
+		if (n != 1) return FR_DISK_ERR;
+
+		n = 0;
+		res = hdd_read_data(id, one.lba, 1, hdd_verify_match, &n);
+		if (verify_miscompare) return 0;
+		if (res) return res;
+		if (n != 1) return FR_DISK_ERR;
+		(*act_len)++;
+	}
+	return 0;
+}
+#endif
+
 /*
  * ============================================================================
  *   OPERATION HANDLERS
@@ -276,22 +1235,14 @@ static void hdd_cmd_read(uint8_t id, uint8_t* cmd)
 		}
 		phy_phase(PHY_PHASE_DATA_IN);
 
-		uint8_t res = 255;
 		uint16_t act_len = 0;
-		if (config_hdd[id].lba > 0) // low-level access
-		{
-			uint32_t offset = config_hdd[id].lba + op.lba;
-			res = disk_read_multi(0, phy_data_offer_block, offset, op.length);
-			if (! res) act_len = op.length;
-		}
-		else // access via FAT
+		uint8_t res = hdd_prefetch_read(id, op.lba, op.length, &act_len);
+		if (! res && act_len < op.length)
 		{
-			// move to correct sector
-			if (! hdd_seek(id, op.lba)) return;
-
-			// read from card
-			res = f_mread(&(config_hdd[id].fp), phy_data_offer_block,
-					op.length, &act_len, 0);
+			uint16_t card_len = 0;
+			res = hdd_read_data(id, op.lba + act_len, op.length - act_len,
+					phy_data_offer_block, &card_len);
+			act_len += card_len;
 		}
 
 		if (res || act_len != op.length)
@@ -307,7 +1258,7 @@ static void hdd_cmd_read(uint8_t id, uint8_t* cmd)
 						(uint8_t) act_len);
 				}
 			}
-			state = HDD_ERROR;
+			state[id] = HDD_ERROR;
 			logic_set_sense(SENSE_MEDIUM_ERROR, 0);
 			logic_status(LOGIC_STATUS_CHECK_CONDITION);
 			logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
@@ -345,22 +1296,25 @@ static void hdd_cmd_write(uint8_t id, uint8_t* cmd)
 		}
 		phy_phase(PHY_PHASE_DATA_OUT);
 
-		uint8_t res = 255;
 		uint16_t act_len = 0;
-		if (config_hdd[id].lba > 0) // low-level access
+		uint8_t res;
+#ifdef VERIFY_BUFFER
+		if (cmd[0] == 0x2E)
 		{
-			uint32_t offset = config_hdd[id].lba + op.lba;
-			res = disk_write_multi(0, phy_data_ask_block, offset, op.length);
-			if (! res) act_len = op.length;
+			res = hdd_write_verify(id, &op, &act_len);
+			if (verify_miscompare)
+			{
+				debug(DEBUG_HDD_MISCOMPARE);
+				logic_set_sense(SENSE_MISCOMPARE, verify_offset);
+				logic_status(LOGIC_STATUS_CHECK_CONDITION);
+				logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+				return;
+			}
 		}
-		else // access via FAT
+		else
+#endif
 		{
-			// move to correct sector
-			if (! hdd_seek(id, op.lba)) return;
-
-			// write to card
-			res = f_mwrite(&(config_hdd[id].fp), phy_data_ask_block,
-					op.length, &act_len);
+			res = hdd_write_data(id, &op, phy_data_ask_block, &act_len);
 		}
 
 		if (res || act_len != op.length)
@@ -376,12 +1330,37 @@ static void hdd_cmd_write(uint8_t id, uint8_t* cmd)
 						(uint8_t) act_len);
 				}
 			}
-			state = HDD_ERROR;
+			state[id] = HDD_ERROR;
 			logic_set_sense(SENSE_MEDIUM_ERROR, 0);
 			logic_status(LOGIC_STATUS_CHECK_CONDITION);
 			logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
 			return;
 		}
+
+#ifndef VERIFY_BUFFER
+		/*
+		 * Without room to keep a copy of each block, WRITE AND VERIFY only
+		 * reads the new sectors back from the card once they are all written.
+		 * This checks that they can be read, not that they match what the
+		 * initiator sent; the card has already confirmed each block was
+		 * programmed as part of the write.
+		 */
+		if (cmd[0] == 0x2E)
+		{
+			act_len = 0;
+			res = hdd_read_data(id, op.lba, op.length,
+					hdd_verify_discard, &act_len);
+			if (res || act_len != op.length)
+			{
+				debug_dual(DEBUG_HDD_MEM_READ_ERROR, res);
+				state[id] = HDD_ERROR;
+				logic_set_sense(SENSE_MEDIUM_ERROR, 0);
+				logic_status(LOGIC_STATUS_CHECK_CONDITION);
+				logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+				return;
+			}
+		}
+#endif
 	}
 
 	debug(DEBUG_HDD_WRITE_OKAY);
@@ -733,32 +1712,42 @@ static void hdd_cmd_mode_sense(uint8_t id, uint8_t* cmd)
 
 static void hdd_cmd_verify(uint8_t id, uint8_t* cmd)
 {
-	(void) id; // silence compiler warning
+	LogicDataOp op;
+	if (! hdd_parse_op(id, cmd, &op, 1)) return;
 	debug(DEBUG_HDD_VERIFY);
 
-	if (cmd[1] & 1)
-	{
-		// RelAdr set
-		logic_cmd_illegal_arg(1);
-		return;
-	}
-	if (cmd[1] & 2)
+	/*
+	 * Without BytChk this is a request to verify the medium. The card does its
+	 * own error correction and any sector that cannot be read will be reported
+	 * when it is accessed, so this completes right away instead of reading
+	 * through what is often the entire drive.
+	 */
+	if ((cmd[1] & 2) && op.length > 0)
 	{
-		/*
-		 * This is a dummy operation: we just pretend to care about what the
-		 * initiator is asking for, and we don't verify anything: just get
-		 * the DATA IN length we need to do and report that everything is OK.
-		 */
-		phy_phase(PHY_PHASE_DATA_IN);
-		uint16_t len = (cmd[7] << 8) | cmd[8];
-		for (uint16_t i = 0; i < len; i++)
+		phy_phase(PHY_PHASE_DATA_OUT);
+
+		verify_offset = 0;
+		verify_miscompare = 0;
+		uint16_t act_len = 0;
+		uint8_t res = hdd_read_data(id, op.lba, op.length,
+				hdd_verify_block, &act_len);
+
+		if (verify_miscompare)
 		{
-			for (uint16_t j = 0; j < 512; j++)
-			{
-				// this will be glacial, but this should be an uncommon
-				// operation anyway
-				phy_data_ask();
-			}
+			debug(DEBUG_HDD_MISCOMPARE);
+			logic_set_sense(SENSE_MISCOMPARE, verify_offset);
+			logic_status(LOGIC_STATUS_CHECK_CONDITION);
+			logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+			return;
+		}
+		else if (res || act_len != op.length)
+		{
+			debug_dual(DEBUG_HDD_MEM_READ_ERROR, res);
+			state[id] = HDD_ERROR;
+			logic_set_sense(SENSE_MEDIUM_ERROR, 0);
+			logic_status(LOGIC_STATUS_CHECK_CONDITION);
+			logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+			return;
 		}
 	}
 
@@ -881,22 +1870,129 @@ static void hdd_cmd_seek(uint8_t id, uint8_t* cmd)
 		}
 	}
 
-	if (config_hdd[id].lba > 0) // low-level access
+	/*
+	 * The card has no real seek time, but drivers that SEEK usually READ from
+	 * the same place next. Take this as a hint to load the sectors there
+	 * once the bus is free.
+	 */
+	hdd_prefetch_hint(id, op.lba, 0);
+
+	logic_status(LOGIC_STATUS_GOOD);
+	logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+}
+
+static void hdd_cmd_prefetch(uint8_t id, uint8_t* cmd)
+{
+	LogicDataOp op;
+	if (! hdd_parse_op(id, cmd, &op, 1)) return;
+	debug(DEBUG_HDD_PREFETCH);
+
+	// without IMMED the sectors should be loaded before status is given
+	hdd_prefetch_hint(id, op.lba, op.length);
+	if (! (cmd[1] & 2)) hdd_prefetch_check();
+
+	logic_status(LOGIC_STATUS_GOOD);
+	logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+}
+
+#ifdef USE_TOOLBOX
+/*
+ * Vendor-specific command to drop everything written to the drive's overlay,
+ * returning it to the contents of the drive image.
+ */
+static void hdd_cmd_discard_overlay(uint8_t id, uint8_t* cmd)
+{
+	HDDOverlay* ov = hdd_overlay(id);
+	if (ov == NULL)
 	{
-		/*
-		 * Consider native access to have "free" seeks due to the very low card
-		 * seek time, so just do nothing here and pretend to have seeked.
-		 */
+		logic_cmd_illegal_op(cmd[0]);
+		return;
 	}
-	else // access via FAT
+
+	debug_dual(DEBUG_HDD_OVERLAY_DISCARD, id);
+	hdd_prefetch_forget();
+	if (hdd_overlay_reset(ov))
+	{
+		state[id] = HDD_ERROR;
+		logic_set_sense(SENSE_MEDIUM_ERROR, 0);
+		logic_status(LOGIC_STATUS_CHECK_CONDITION);
+		logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+		return;
+	}
+
+	logic_status(LOGIC_STATUS_GOOD);
+	logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+}
+
+/*
+ * Vendor-specific command to switch the drive over to a different image file
+ * without restarting. The new name is sent during DATA OUT. If the new image
+ * cannot be opened, the old one is put back. Fast modes are checked again in
+ * the background, and the next command gets UNIT ATTENTION so the initiator
+ * knows the medium has changed.
+ */
+static void hdd_cmd_swap_image(uint8_t id, uint8_t* cmd)
+{
+	// images under an overlay and raw volumes cannot be swapped out
+	if (hdd_overlay(id) != NULL || config_hdd[id].mode == HDD_MODE_RAW)
+	{
+		logic_cmd_illegal_op(cmd[0]);
+		return;
+	}
+	uint8_t len = cmd[8];
+	if (len == 0 || len >= HDD_FILENAME_SIZE)
+	{
+		logic_cmd_illegal_arg(8);
+		return;
+	}
+
+	char name[HDD_FILENAME_SIZE];
+	if (logic_data_out((uint8_t*) name, len) != len)
+	{
+		phy_phase(PHY_PHASE_BUS_FREE);
+		return;
+	}
+	name[len] = '\0';
+
+	// wait for other card activity to finish before touching the file
+	if (open_pending || create_id != 255
+			|| (GLOBAL_CONFIG_REGISTER & GLOBAL_FLAG_HDD_CHECKING))
+	{
+		logic_set_sense(SENSE_BECOMING_READY, 0);
+		logic_status(LOGIC_STATUS_CHECK_CONDITION);
+		logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+		return;
+	}
+
+	FIL* fp = &(config_hdd[id].fp);
+	hdd_prefetch_forget();
+	FRESULT res = f_close(fp);
+	if (! res) res = hdd_open_image(id, name, FA_READ | FA_WRITE);
+	if (res)
 	{
-		// move to correct sector
-		if (! hdd_seek(id, op.lba)) return;
+		debug_dual(DEBUG_HDD_SWAP_FAILED, id);
+		debug(res);
+		if (hdd_open_image(id, config_hdd[id].filename, FA_READ | FA_WRITE))
+		{
+			state[id] = HDD_ERROR;
+		}
+		logic_set_sense(SENSE_INVALID_PARAMETER, 0);
+		logic_status(LOGIC_STATUS_CHECK_CONDITION);
+		logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+		return;
 	}
 
+	debug_dual(DEBUG_HDD_SWAP, id);
+	memcpy(config_hdd[id].filename, name, HDD_FILENAME_SIZE);
+	config_hdd[id].lba = 0;
+	check_pending |= _BV(id);
+	GLOBAL_CONFIG_REGISTER &= ~GLOBAL_FLAG_HDD_CHECKED;
+	attention |= _BV(id);
+
 	logic_status(LOGIC_STATUS_GOOD);
 	logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
 }
+#endif
 
 /*
  * ============================================================================
@@ -906,96 +2002,333 @@ static void hdd_cmd_seek(uint8_t id, uint8_t* cmd)
 
 uint16_t hdd_init(void)
 {
+	for (uint8_t i = 0; i < HARD_DRIVE_COUNT; i++)
+	{
+		state[i] = HDD_NOINIT;
+		if (config_hdd[i].id != 255)
+		{
+			// file should be defined, but double check anyway
+			if (config_hdd[i].mode != HDD_MODE_RAW
+					&& config_hdd[i].filename[0] == '\0')
+			{
+				return ((i + 1) << 8) + (uint8_t) FR_INT_ERR;
+			}
+
+			// the file itself is opened later, from the main loop
+			open_pending |= _BV(i);
+			check_pending |= _BV(i);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Marks the given drive as ready for use, reporting the time it took to get
+ * there if debugging is enabled.
+ */
+static void hdd_ready(uint8_t id)
+{
+	state[id] = HDD_OK;
+	if (debug_enabled())
+	{
+		uint16_t uptime = debug_uptime();
+		debug_dual(DEBUG_HDD_READY, id);
+		debug_dual((uint8_t) (uptime >> 8), (uint8_t) uptime);
+	}
+}
+
+/*
+ * Sets up a raw volume that maps directly onto the memory card. If a partition
+ * was given, the start and size come from the MBR partition table, otherwise
+ * the LBA range from the configuration is used as-is.
+ */
+static FRESULT hdd_open_raw(uint8_t id)
+{
+	if (config_hdd[id].part > 0)
+	{
+		if (disk_read(0, global_buffer, 0, 1) != RES_OK) return FR_DISK_ERR;
+		if (global_buffer[510] != 0x55 || global_buffer[511] != 0xAA)
+		{
+			return FR_NO_FILESYSTEM;
+		}
+
+		// partition types 0x00 (empty) and 0xEE (GPT) are not usable
+		uint8_t* entry = global_buffer + 446 + ((config_hdd[id].part - 1) << 4);
+		if (entry[4] == 0x00 || entry[4] == 0xEE) return FR_NO_FILESYSTEM;
+		config_hdd[id].lba = hdd_le32_get(entry + 8);
+		config_hdd[id].size = hdd_le32_get(entry + 12);
+	}
+
+	if (config_hdd[id].lba == 0 || config_hdd[id].size == 0)
+	{
+		return FR_INVALID_PARAMETER;
+	}
+	if (debug_verbose())
+	{
+		debug(DEBUG_HDD_LBA);
+		debug(config_hdd[id].lba >> 24);
+		debug(config_hdd[id].lba >> 16);
+		debug(config_hdd[id].lba >> 8);
+		debug(config_hdd[id].lba);
+	}
+	return FR_OK;
+}
+
+/*
+ * Finishes opening a drive once its image is available, opening (or starting
+ * the creation of) its overlay first if one was configured.
+ */
+static void hdd_open_finish(uint8_t id, FSEXPAND* ce)
+{
+	HDDOverlay* ov = hdd_overlay(id);
+	if (ov == NULL)
+	{
+		hdd_ready(id);
+		return;
+	}
+
+	if (config_hdd[id].size > OVERLAY_MAX_SECTORS)
+	{
+		fatal(id + 1, FR_INVALID_PARAMETER);
+	}
+
+	/*
+	 * Missing delta files are created in the background just like images
+	 * are, and set up once allocation finishes.
+	 */
+	FILINFO fno;
+	FRESULT res = f_stat(ov->filename, &fno);
+	if (res == FR_NO_FILE || (res == FR_OK && fno.fsize == 0))
+	{
+		debug_dual(DEBUG_HDD_CREATE_STARTED, id);
+		uint32_t need = hdd_overlay_data(id) + config_hdd[id].size;
+		res = f_open(&(ov->fp), ov->filename,
+				FA_OPEN_ALWAYS | FA_READ | FA_WRITE);
+		if (! res)
+		{
+#if ! FF_FS_EXFAT
+			// would not fit in the 32-bit file size
+			if (need > 0x7FFFFF) res = FR_DENIED;
+#endif
+			if (! res)
+			{
+				res = f_expand_setup(&(ov->fp), (FSIZE_t) need * 512, ce);
+			}
+			if (res) f_close(&(ov->fp));
+		}
+		if (res)
+		{
+			debug_dual(DEBUG_HDD_CREATE_FAILED, id);
+			debug(res);
+			state[id] = HDD_ERROR;
+			return;
+		}
+
+		// allocation starts with the next call
+		create_id = id;
+		create_fp = &(ov->fp);
+		return;
+	}
+
+	if (! res) res = f_open(&(ov->fp), ov->filename, FA_READ | FA_WRITE);
+	if (! res) res = hdd_overlay_check(id, ov, 0);
+	if (res)
+	{
+		fatal(id + 1, res);
+	}
+	hdd_ready(id);
+}
+
+void hdd_open_check(void)
+{
+	static FSEXPAND ce;
+
 	FRESULT res;
 	FILINFO fno;
 	FIL* fp;
-	uint16_t err;
 
-	for (uint8_t i = 0; i < HARD_DRIVE_COUNT; i++)
+	/*
+	 * If no image is being created, open the next drive in line. This may
+	 * take a while on a slow card, so only one drive is handled per call.
+	 */
+	if (create_id == 255)
 	{
-		err = (i + 1) << 8;
-		if (config_hdd[i].id != 255)
-		{
-			fp = &(config_hdd[i].fp);
+		if (! open_pending) return;
 
-			// file should be defined, but double check anyway
-			if (config_hdd[i].filename == NULL)
+		uint8_t id = 0;
+		while (! (open_pending & _BV(id))) id++;
+		open_pending &= ~_BV(id);
+		fp = &(config_hdd[id].fp);
+
+		// raw volumes have no file to open
+		if (config_hdd[id].mode == HDD_MODE_RAW)
+		{
+			res = hdd_open_raw(id);
+			if (res)
 			{
-				err += (uint8_t) FR_INT_ERR;
-				return err;
+				fatal(id + 1, res);
 			}
+			hdd_open_finish(id, &ce);
+			return;
+		}
 
-			/*
-			 * Verify the file exists. If it does not exist, we may have been
-			 * asked to create it.
-			 */
-			res = f_stat(config_hdd[i].filename, &fno);
-			if (res == FR_NO_FILE)
+		/*
+		 * Verify the file exists. If it does not exist, we may have been
+		 * asked to create it. A zero-length file left behind by an
+		 * interrupted creation is treated the same way. Drives with an
+		 * overlay need an existing image, since it is never written to.
+		 */
+		HDDOverlay* ov = hdd_overlay(id);
+		res = f_stat(config_hdd[id].filename, &fno);
+		if ((res == FR_NO_FILE || (res == FR_OK && fno.fsize == 0))
+				&& config_hdd[id].size > 0 && ov == NULL)
+		{
+			debug_dual(DEBUG_HDD_CREATE_STARTED, id);
+			res = f_open(fp, config_hdd[id].filename,
+					FA_OPEN_ALWAYS | FA_READ | FA_WRITE);
+			if (! res)
 			{
-				if (config_hdd[i].size > 0)
+				/*
+				 * Keep the size within what READ CAPACITY can report, and
+				 * below 4GB unless the volume is exFAT.
+				 */
+				uint32_t mb = config_hdd[id].size;
+				if (mb > HDD_MAX_CREATE_SIZE) mb = HDD_MAX_CREATE_SIZE;
+#if FF_FS_EXFAT
+				if (fp->obj.fs->fs_type != FS_EXFAT && mb > 0xFFF) mb = 0xFFF;
+#else
+				if (mb > 0xFFF) mb = 0xFFF;
+#endif
+				if (config_hdd[id].mode == HDD_MODE_SPARSE)
 				{
-					/*
-					 * File does not exist and we have been asked to create it.
-					 * This is done via f_expand() to maximize
-					 * sequential-access performance. This will not work well
-					 * if the drive is fragmented.
-					 */
-					config_hdd[i].size &= 0xFFF; // limit to 4GB
-					config_hdd[i].size <<= 20; // MB to bytes (for now)
-					res = f_open(fp, config_hdd[i].filename,
-							FA_CREATE_NEW | FA_WRITE);
-					if (res)
-					{
-						err += (uint8_t) res;
-						return err;
-					}
-					// allocate the space
-					res = f_expand(fp, config_hdd[i].size, 1);
-					if (res)
-					{
-						err += (uint8_t) res;
-						return err;
-					}
-					// close the file, we'll be re-opening it later in
-					// the normal modes
-					f_close(fp);
-					if (res)
+					// sparse images just need their header and table
+					res = hdd_sparse_create(fp, mb << 11);
+					if (! res) res = hdd_sparse_open(id);
+					if (! res)
 					{
-						err += (uint8_t) res;
-						return err;
+						debug_dual(DEBUG_HDD_CREATE_DONE, id);
+						hdd_ready(id);
+						return;
 					}
 				}
+				else
+				{
+					res = f_expand_setup(fp, (FSIZE_t) mb << 20, &ce);
+				}
+				if (res) f_close(fp);
 			}
-			else if (res == FR_OK)
-			{
-				// allow to flow through
-			}
-			else
+			if (res)
 			{
-				err += (uint8_t) res;
-				return err;
+				debug_dual(DEBUG_HDD_CREATE_FAILED, id);
+				debug(res);
+				state[id] = HDD_ERROR;
+				return;
 			}
 
-			/*
-			 * If we flowed through to here, OK to attempt opening the file.
-			 */
-			res = f_open(fp, config_hdd[i].filename, FA_READ | FA_WRITE);
-			if (res)
+			// allocation starts with the next call
+			create_id = id;
+			create_fp = fp;
+			return;
+		}
+		else if (res)
+		{
+			fatal(id + 1, res);
+		}
+
+		/*
+		 * If we flowed through to here, OK to attempt opening the file.
+		 */
+		res = hdd_open_image(id, config_hdd[id].filename,
+				ov == NULL ? (FA_READ | FA_WRITE) : FA_READ);
+		if (res)
+		{
+			fatal(id + 1, res);
+		}
+		hdd_open_finish(id, &ce);
+		return;
+	}
+
+	/*
+	 * Otherwise, allocate the next slice of the image being created. This is
+	 * done via the incremental version of f_expand() to maximize
+	 * sequential-access performance. This will not work well if the drive is
+	 * fragmented.
+	 */
+	fp = create_fp;
+	res = f_expand_step(&ce);
+	if (! res && ce.rem == 0)
+	{
+		// write the directory entry so the allocation survives a reset
+		res = f_sync(fp);
+		if (! res)
+		{
+			debug_dual(DEBUG_HDD_CREATE_DONE, create_id);
+			if (fp != &(config_hdd[create_id].fp))
 			{
-				err += (uint8_t) res;
-				return err;
+				// new delta file for an overlay, start it out empty
+				res = hdd_overlay_check(create_id, hdd_overlay(create_id), 1);
 			}
-			config_hdd[i].size = (f_size(fp) >> 9); // store in 512 byte sectors
-			if (config_hdd[i].size == 0)
+			else
 			{
-				err += (uint8_t) FR_INVALID_OBJECT;
-				return err;
+				config_hdd[create_id].size = (f_size(fp) >> 9);
+
+				// the new image is contiguous, so fast modes can start
+				// right away
+				if (config_hdd[create_id].mode != HDD_MODE_NORMAL)
+				{
+					config_hdd[create_id].lba = fp->obj.fs->database
+							+ fp->obj.fs->csize * (fp->obj.sclust - 2);
+				}
 			}
 		}
+		if (! res)
+		{
+			hdd_ready(create_id);
+			create_id = 255;
+		}
 	}
+	if (res)
+	{
+		debug_dual(DEBUG_HDD_CREATE_FAILED, create_id);
+		debug(res);
+		f_close(fp);
+		state[create_id] = HDD_ERROR;
+		create_id = 255;
+	}
+}
 
-	state = HDD_OK;
-	return 0;
+void hdd_prefetch_check(void)
+{
+	if (! prefetch_pending) return;
+	prefetch_pending = 0;
+
+	uint8_t id = prefetch_id;
+	if (state[id] != HDD_OK) return;
+
+#ifdef PREFETCH_BUFFER
+	// SEEK gives no length, and PRE-FETCH can ask for more than fits
+	uint16_t length = prefetch_length;
+	if (length == 0 || length > PREFETCH_MAX) length = PREFETCH_MAX;
+	if (prefetch_lba + length > config_hdd[id].size)
+		length = config_hdd[id].size - prefetch_lba;
+
+	uint16_t act_len = 0;
+	prefetch_count = 0;
+	if (hdd_read_data(id, prefetch_lba, length,
+			hdd_prefetch_block, &act_len))
+	{
+		// the READ will run into the problem itself and report it
+		prefetch_count = 0;
+	}
+#else
+	// only able to have FatFs walk the cluster chain ahead of time
+	if (hdd_overlay(id) == NULL && config_hdd[id].lba == 0
+			&& config_hdd[id].mode != HDD_MODE_SPARSE)
+	{
+		f_lseek(&(config_hdd[id].fp), (FSIZE_t) prefetch_lba * 512);
+	}
+#endif
 }
 
 void hdd_contiguous_check(void)
@@ -1006,8 +2339,9 @@ void hdd_contiguous_check(void)
 
 	FRESULT res;
 
-	// block further calls once configured
+	// block further calls once configured, or until all drives are open
 	if (GLOBAL_CONFIG_REGISTER & GLOBAL_FLAG_HDD_CHECKED) return;
+	if (open_pending || create_id != 255) return;
 
 	/*
 	 * If this function is called without this flag set, that is a directive
@@ -1028,8 +2362,12 @@ void hdd_contiguous_check(void)
 	{
 		while (cont_hdd_id < HARD_DRIVE_COUNT)
 		{
-			// if this volume is not configured, move to the next one
-			if (config_hdd[cont_hdd_id].id == 255)
+			// if this volume is not configured, failed to open, or was
+			// created contiguous at startup, move to the next one
+			if (config_hdd[cont_hdd_id].id == 255
+					|| state[cont_hdd_id] != HDD_OK
+					|| config_hdd[cont_hdd_id].lba > 0
+					|| ! (check_pending & _BV(cont_hdd_id)))
 			{
 				cont_hdd_id++;
 				continue;
@@ -1038,6 +2376,22 @@ void hdd_contiguous_check(void)
 			// otherwise check for fast/forcefast modes
 			if (config_hdd[cont_hdd_id].mode == HDD_MODE_FAST)
 			{
+#if FF_FS_EXFAT
+				/*
+				 * exFAT flags files that have no FAT chain because they are
+				 * stored contiguously, so there is nothing to scan.
+				 */
+				FIL* fp_ptr = &(config_hdd[cont_hdd_id].fp);
+				if (fp_ptr->obj.fs->fs_type == FS_EXFAT
+						&& fp_ptr->obj.stat == 2)
+				{
+					debug_dual(DEBUG_HDD_CHECK_SUCCESS, cont_hdd_id);
+					config_hdd[cont_hdd_id].lba = fp_ptr->obj.fs->database
+							+ fp_ptr->obj.fs->csize * (fp_ptr->obj.sclust - 2);
+					cont_hdd_id++;
+					continue;
+				}
+#endif
 				/*
 				 * Open a new pointer to the file. This violates the FatFs
 				 * rules at http://elm-chan.org/fsw/ff/doc/appnote.html#dup by
@@ -1098,6 +2452,7 @@ void hdd_contiguous_check(void)
 		if (cont_hdd_id >= HARD_DRIVE_COUNT)
 		{
 			// checks complete
+			check_pending = 0;
 			GLOBAL_CONFIG_REGISTER &= ~GLOBAL_FLAG_HDD_CHECKING;
 			GLOBAL_CONFIG_REGISTER |= GLOBAL_FLAG_HDD_CHECKED;
 		}
@@ -1138,9 +2493,9 @@ void hdd_contiguous_check(void)
 	}
 }
 
-HDDSTATE hdd_state(void)
+HDDSTATE hdd_state(uint8_t id)
 {
-	return state;
+	return state[id];
 }
 
 uint8_t hdd_main(uint8_t id)
@@ -1154,17 +2509,17 @@ uint8_t hdd_main(uint8_t id)
 	if (! logic_command(cmd)) return 1; // takes care of disconnection on fail
 
 	/*
-	 * If there is a subsystem problem, we prevent further calls to commands,
-	 * except those that are supposed to reply unless there is a critical
-	 * problem.
+	 * If there is a problem with this drive, we prevent further calls to
+	 * commands, except those that are supposed to reply unless there is a
+	 * critical problem.
 	 */
 	if (! (cmd[0] == 0x03 || cmd[0] == 0x12))
 	{
-		if (state == HDD_OK)
+		if (state[id] == HDD_OK)
 		{
 			// no issue, allow flow to continue
 		}
-		else if (state == HDD_NOINIT)
+		else if (state[id] == HDD_NOINIT)
 		{
 			// system is still becoming ready
 			debug(DEBUG_HDD_NOT_READY);
@@ -1183,6 +2538,17 @@ uint8_t hdd_main(uint8_t id)
 		}
 	}
 
+	// report an image swap once, to the first command that can take it
+	if ((attention & _BV(id)) && ! (cmd[0] == 0x03 || cmd[0] == 0x12))
+	{
+		attention &= ~_BV(id);
+		logic_set_sense(SENSE_MEDIUM_CHANGED, 0);
+		logic_status(LOGIC_STATUS_CHECK_CONDITION);
+		logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+		logic_done();
+		return 1;
+	}
+
 #ifdef USE_TOOLBOX
 	if (toolbox_main(cmd))
 	{
@@ -1238,15 +2604,29 @@ uint8_t hdd_main(uint8_t id)
 		case 0x15: // MODE SELECT(6)
 			hdd_cmd_mode_select(id, cmd);
 			break;
+		case 0x2E: // WRITE AND VERIFY
+			hdd_cmd_write(id, cmd);
+			break;
 		case 0x2F: // VERIFY
 			hdd_cmd_verify(id, cmd);
 			break;
+		case 0x34: // PRE-FETCH
+			hdd_cmd_prefetch(id, cmd);
+			break;
 		case 0x3C: // READ BUFFER
 			hdd_cmd_read_buffer(id, cmd);
 			break;
 		case 0x3B: // WRITE BUFFER
 			hdd_cmd_write_buffer(id, cmd);
 			break;
+#ifdef USE_TOOLBOX
+		case 0xD3: // discard overlay (vendor specific)
+			hdd_cmd_discard_overlay(id, cmd);
+			break;
+		case 0xD4: // swap image (vendor specific)
+			hdd_cmd_swap_image(id, cmd);
+			break;
+#endif
 		default:
 			logic_cmd_illegal_op(cmd[0]);
 	}
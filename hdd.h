@@ -57,8 +57,10 @@ typedef enum {
 } HDDSTATE;
 
 /*
- * Called when the files on the memory card have been mounted and are ready for
- * use.
+ * Called once the configuration has been read to prepare the hard drives. This
+ * does not access the memory card: all drives start in the HDD_NOINIT state,
+ * reporting that they are becoming ready, until hdd_open_check() opens (and,
+ * if needed, creates) their image files.
  * 
  * This will return 0 on success. If non-zero, the hard drive image number that
  * caused the failure will be in the upper eight bits, and the specific error
@@ -66,20 +68,41 @@ typedef enum {
  */
 uint16_t hdd_init(void);
 
+/*
+ * Opens the image files for each configured drive, creating any that are
+ * missing a small step at a time. This needs to be called as part of the main
+ * loop, and will return immediately once all drives are ready.
+ * 
+ * If an existing image cannot be opened, this will directly invoke fatal()
+ * with the same codes hdd_init() would provide.
+ * 
+ * Should not be invoked until hdd_init() returns correctly.
+ */
+void hdd_open_check(void);
+
 /*
  * Checks for volume continuity among those marked for fast mode. This needs to
  * be called as part of the main loop. Each invocation, it will perform one
  * step of the check, until eventually it completes all checks, after which it
- * will begin returning immediately.
+ * will begin returning immediately. Checking will not start until
+ * hdd_open_check() has finished with all drives.
  * 
  * Should not be invoked until hdd_init() returns correctly.
  */
 void hdd_contiguous_check(void);
 
 /*
- * Provides the current state of the hard drive subsystem.
+ * Loads the sectors named by the last SEEK or PRE-FETCH command, so a READ that
+ * follows can be answered without waiting on the memory card. This needs to
+ * be called as part of the main loop, and returns immediately when there is
+ * nothing to do.
+ */
+void hdd_prefetch_check(void);
+
+/*
+ * Provides the current state of the given hard drive.
  */
-HDDSTATE hdd_state(void);
+HDDSTATE hdd_state(uint8_t);
 
 /*
  * Called whenever the PHY detects that the hard drive has been selected. This
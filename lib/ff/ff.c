@@ -1018,11 +1018,79 @@ static void clear_lock (	/* Clear lock entries of the volume */
 
 
 
+/*-----------------------------------------------------------------------*/
+/* System area sector cache behind the disk access window                */
+/*-----------------------------------------------------------------------*/
+#if FF_WIN_CACHE && !FF_FS_READONLY
+/* scuznet change: sectors in the system area (FATs and the FAT12/16 root
+/  directory) that are moved out of the window are parked in a small LRU
+/  cache instead of being written back immediately. Data area sectors are
+/  never cached, since they can be written behind the window's back; this
+/  includes every directory on FAT32 and exFAT, so only FAT traffic (and
+/  the root directory on FAT12/16) benefits there. */
+
+static BYTE wc_buf[FF_WIN_CACHE][FF_MAX_SS];	/* Cached sector data */
+static LBA_t wc_sect[FF_WIN_CACHE];				/* Cached sector numbers, -1 when empty */
+static BYTE wc_dirty[FF_WIN_CACHE];				/* Dirty flags for the above */
+static WORD wc_used[FF_WIN_CACHE];				/* Last use tick, 0 when empty */
+static WORD wc_tick;
+static DWORD wc_hits, wc_misses;
+
+#define win_cacheable(fs, sect) ((fs)->fs_type && (sect) >= (fs)->fatbase && (sect) < (fs)->database)
+
+static void wc_clear (void)
+{
+	UINT i;
+
+	for (i = 0; i < FF_WIN_CACHE; i++) {
+		wc_sect[i] = (LBA_t)0 - 1; wc_dirty[i] = 0; wc_used[i] = 0;
+	}
+}
+
+static void wc_touch (	/* Marks a slot as the most recently used */
+	UINT n				/* Slot index */
+)
+{
+	UINT i, j;
+	BYTE rank[FF_WIN_CACHE];
+
+
+	if (wc_tick == 0xFFFF) {	/* Renumber the used slots in LRU order before the tick wraps */
+		for (i = 0; i < FF_WIN_CACHE; i++) {
+			rank[i] = 0;
+			if (wc_used[i]) {
+				for (rank[i] = 1, j = 0; j < FF_WIN_CACHE; j++) {
+					if (wc_used[j] && wc_used[j] < wc_used[i]) rank[i]++;
+				}
+			}
+		}
+		for (i = 0; i < FF_WIN_CACHE; i++) wc_used[i] = rank[i];
+		wc_tick = FF_WIN_CACHE;
+	}
+	wc_used[n] = ++wc_tick;
+}
+#endif
+
+
 /*-----------------------------------------------------------------------*/
 /* Move/Flush disk access window in the filesystem object                */
 /*-----------------------------------------------------------------------*/
 #if !FF_FS_READONLY
-static FRESULT sync_window (	/* Returns FR_OK or FR_DISK_ERR */
+static FRESULT write_window (	/* Returns FR_OK or FR_DISK_ERR */
+	FATFS* fs,			/* Filesystem object */
+	const BYTE* buff,	/* Sector data to write */
+	LBA_t sect			/* Sector the data belongs to */
+)
+{
+	if (disk_write(fs->pdrv, buff, sect, 1) != RES_OK) return FR_DISK_ERR;	/* Write it back into the volume */
+	if (sect - fs->fatbase < fs->fsize) {	/* Is it in the 1st FAT? */
+		if (fs->n_fats == 2) disk_write(fs->pdrv, buff, sect + fs->fsize, 1);	/* Reflect it to 2nd FAT if needed */
+	}
+	return FR_OK;
+}
+
+
+static FRESULT flush_window (	/* Returns FR_OK or FR_DISK_ERR */
 	FATFS* fs			/* Filesystem object */
 )
 {
@@ -1030,15 +1098,32 @@ static FRESULT sync_window (	/* Returns FR_OK or FR_DISK_ERR */
 
 
 	if (fs->wflag) {	/* Is the disk access window dirty? */
-		if (disk_write(fs->pdrv, fs->win, fs->winsect, 1) == RES_OK) {	/* Write it back into the volume */
-			fs->wflag = 0;	/* Clear window dirty flag */
-			if (fs->winsect - fs->fatbase < fs->fsize) {	/* Is it in the 1st FAT? */
-				if (fs->n_fats == 2) disk_write(fs->pdrv, fs->win, fs->winsect + fs->fsize, 1);	/* Reflect it to 2nd FAT if needed */
-			}
-		} else {
-			res = FR_DISK_ERR;
+		res = write_window(fs, fs->win, fs->winsect);
+		if (res == FR_OK) fs->wflag = 0;	/* Clear window dirty flag */
+	}
+	return res;
+}
+
+
+static FRESULT sync_window (	/* Returns FR_OK or FR_DISK_ERR */
+	FATFS* fs			/* Filesystem object */
+)
+{
+	FRESULT res;
+#if FF_WIN_CACHE
+	UINT i;
+#endif
+
+
+	res = flush_window(fs);
+#if FF_WIN_CACHE
+	for (i = 0; i < FF_WIN_CACHE && res == FR_OK; i++) {	/* Write back the dirty cached sectors */
+		if (wc_dirty[i]) {
+			res = write_window(fs, wc_buf[i], wc_sect[i]);
+			if (res == FR_OK) wc_dirty[i] = 0;
 		}
 	}
+#endif
 	return res;
 }
 #endif
@@ -1053,8 +1138,36 @@ static FRESULT move_window (	/* Returns FR_OK or FR_DISK_ERR */
 
 
 	if (sect != fs->winsect) {	/* Window offset changed? */
-#if !FF_FS_READONLY
-		res = sync_window(fs);		/* Flush the window */
+#if FF_WIN_CACHE && !FF_FS_READONLY
+		UINT i, n;
+
+		if (win_cacheable(fs, fs->winsect)) {	/* Park the window in the least recently used slot */
+			for (n = 0, i = 1; i < FF_WIN_CACHE; i++) {
+				if (wc_used[i] < wc_used[n]) n = i;
+			}
+			if (wc_dirty[n]) res = write_window(fs, wc_buf[n], wc_sect[n]);
+			if (res != FR_OK) return res;
+			memcpy(wc_buf[n], fs->win, SS(fs));
+			wc_sect[n] = fs->winsect; wc_dirty[n] = fs->wflag;
+			wc_touch(n);
+			fs->wflag = 0;
+		} else {
+			res = flush_window(fs);		/* Flush the window */
+		}
+		if (res == FR_OK && win_cacheable(fs, sect)) {
+			for (i = 0; i < FF_WIN_CACHE && wc_sect[i] != sect; i++) ;
+			if (i < FF_WIN_CACHE) {		/* Cache hit, move it into the window */
+				memcpy(fs->win, wc_buf[i], SS(fs));
+				fs->wflag = wc_dirty[i];
+				wc_sect[i] = (LBA_t)0 - 1; wc_dirty[i] = 0; wc_used[i] = 0;
+				fs->winsect = sect;
+				wc_hits++;
+				return FR_OK;
+			}
+			wc_misses++;
+		}
+#elif !FF_FS_READONLY
+		res = flush_window(fs);		/* Flush the window */
 #endif
 		if (res == FR_OK) {			/* Fill sector window with new data */
 			if (disk_read(fs->pdrv, fs->win, sect, 1) != RES_OK) {
@@ -3245,6 +3358,9 @@ static UINT check_fs (	/* 0:FAT/FAT32 VBR, 1:exFAT VBR, 2:Not FAT and valid BS,
 
 
 	fs->wflag = 0; fs->winsect = (LBA_t)0 - 1;		/* Invaidate window */
+#if FF_WIN_CACHE && !FF_FS_READONLY
+	wc_clear();										/* Invalidate the sector cache too */
+#endif
 	if (move_window(fs, sect) != FR_OK) return 4;	/* Load the boot sector */
 	sign = ld_word(fs->win + BS_55AA);
 #if FF_FS_EXFAT
@@ -3974,7 +4090,7 @@ FRESULT f_mread (
 	if (fp->flag & FA_DIRTY) LEAVE_FF(fs, FR_NOT_SYNCED);
 #endif
 
-	for ( ; str > 0; str -= cc, *sr += cc, fp->fptr += cc * SS(fs)) {	/* Repeat until str sectors read */
+	for ( ; str > 0; str -= cc, *sr += cc, fp->fptr += (FSIZE_t)cc * SS(fs)) {	/* Repeat until str sectors read */
 		csect = (UINT)(fp->fptr / SS(fs) & (fs->csize - 1));	/* Sector offset in the cluster */
 		if (csect == 0) {					/* On the cluster boundary? */
 			if (fp->fptr == 0) {			/* On the top of the file? */
@@ -4161,7 +4277,7 @@ FRESULT f_mwrite (
 		stw = ((UINT)(0xFFFFFFFF - (DWORD)fp->fptr)) / SS(fs);
 	}
 
-	for ( ; stw > 0; stw -= cc, *sw += cc, fp->fptr += cc * SS(fs), fp->obj.objsize = (fp->fptr > fp->obj.objsize) ? fp->fptr : fp->obj.objsize) {	/* Repeat until all data written */
+	for ( ; stw > 0; stw -= cc, *sw += cc, fp->fptr += (FSIZE_t)cc * SS(fs), fp->obj.objsize = (fp->fptr > fp->obj.objsize) ? fp->fptr : fp->obj.objsize) {	/* Repeat until all data written */
 		csect = (UINT)(fp->fptr / SS(fs)) & (fs->csize - 1);	/* Sector offset in the cluster */
 		if (csect == 0) {				/* On the cluster boundary? */
 			if (fp->fptr == 0) {		/* On the top of the file? */
@@ -4871,6 +4987,66 @@ FRESULT f_readdir (
 
 
 
+
+/*-----------------------------------------------------------------------*/
+/* Open a File by Directory Offset (scuznet addition)                    */
+/*-----------------------------------------------------------------------*/
+/* Opens the item at the given offset of an open directory for reading,
+/  without looking it up by name. The offset is the dptr value of the
+/  directory object before the f_readdir() call that returned the item. */
+
+FRESULT f_openat (
+	FIL* fp,			/* Pointer to the blank file object */
+	DIR* dp,			/* Pointer to the open directory object */
+	DWORD ofs			/* Directory offset of the item */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DEF_NAMBUF
+
+
+	if (!fp) return FR_INVALID_OBJECT;
+	fp->obj.fs = 0;		/* Invalidate the file object until opened */
+	res = validate(&dp->obj, &fs);	/* Check validity of the directory object */
+	if (res == FR_OK) {
+		INIT_NAMBUF(fs);
+		res = dir_sdi(dp, ofs);			/* Move to the item */
+		if (res == FR_OK) res = DIR_READ_FILE(dp);
+		if (res == FR_OK && (dp->obj.attr & AM_DIR)) res = FR_NO_FILE;	/* Cannot open a directory */
+		if (res == FR_OK) {
+#if FF_FS_EXFAT
+			if (fs->fs_type == FS_EXFAT) {
+				fp->obj.c_scl = dp->obj.sclust;							/* Get containing directory info */
+				fp->obj.c_size = ((DWORD)dp->obj.objsize & 0xFFFFFF00) | dp->obj.stat;
+				fp->obj.c_ofs = dp->blk_ofs;
+				init_alloc_info(fs, &fp->obj);
+			} else
+#endif
+			{
+				fp->obj.sclust = ld_clust(fs, dp->dir);					/* Get object allocation info */
+				fp->obj.objsize = ld_dword(dp->dir + DIR_FileSize);
+			}
+#if !FF_FS_READONLY
+			fp->dir_sect = fs->winsect;		/* Pointer to the directory entry */
+			fp->dir_ptr = dp->dir;
+#endif
+#if FF_USE_FASTSEEK
+			fp->cltbl = 0;		/* Disable fast seek mode */
+#endif
+			fp->obj.fs = fs;	/* Validate the file object */
+			fp->obj.id = fs->id;
+			fp->flag = FA_READ;	/* Read-only access */
+			fp->err = 0;		/* Clear error flag */
+			fp->sect = 0;		/* Invalidate current data sector */
+			fp->fptr = 0;		/* Set file pointer top of the file */
+		}
+		FREE_NAMBUF();
+	}
+	LEAVE_FF(fs, res);
+}
+
+
 #if FF_USE_FIND
 /*-----------------------------------------------------------------------*/
 /* Find Next File                                                        */
@@ -5785,10 +5961,145 @@ FRESULT f_expand (
 	LEAVE_FF(fs, res);
 }
 
+/*-----------------------------------------------------------------------*/
+/* Allocate a Contiguous Blocks to the File, a Piece at a Time           */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_expand_setup (
+	FIL* fp,		/* Pointer to the file object */
+	FSIZE_t fsz,	/* File size to be expanded to */
+	FSEXPAND* ce	/* Expansion object to prepare */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD n;
+
+
+	ce->fp = fp; ce->rem = 0;
+	res = validate(&fp->obj, &fs);		/* Check validity of the file object */
+	if (res != FR_OK || (res = (FRESULT)fp->err) != FR_OK) LEAVE_FF(fs, res);
+	if (fsz == 0 || fp->obj.objsize != 0 || !(fp->flag & FA_WRITE)) LEAVE_FF(fs, FR_DENIED);
+#if FF_FS_EXFAT
+	if (fs->fs_type != FS_EXFAT && fsz >= 0x100000000) LEAVE_FF(fs, FR_DENIED);	/* Check if in size limit */
+#endif
+	n = (DWORD)fs->csize * SS(fs);	/* Cluster size */
+	ce->fsz = fsz;
+	ce->tcl = (DWORD)(fsz / n) + ((fsz & (n - 1)) ? 1 : 0);	/* Number of clusters required */
+	ce->stcl = fs->last_clst;
+	if (ce->stcl < 2 || ce->stcl >= fs->n_fatent) ce->stcl = 2;
+	ce->scl = ce->clst = ce->stcl; ce->ncl = 0;
+	ce->alloc = 0;
+	ce->rem = ce->tcl;
+
+	LEAVE_FF(fs, FR_OK);
+}
+
+FRESULT f_expand_step (
+	FSEXPAND* ce	/* Expansion object from f_expand_setup() */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	FIL* fp = ce->fp;
+	DWORD n, cnt;
+
+
+	if (ce->rem == 0) return FR_OK;		/* Nothing left to do */
+	res = validate(&fp->obj, &fs);		/* Check validity of the file object */
+	if (res != FR_OK) LEAVE_FF(fs, res);
+
+#if FF_FS_EXFAT
+	if (fs->fs_type == FS_EXFAT) {	/* The bitmap is compact, so do it all at once */
+		ce->scl = find_bitmap(fs, ce->stcl, ce->tcl);	/* Find a contiguous cluster block */
+		if (ce->scl == 0) res = FR_DENIED;				/* No contiguous cluster block was found */
+		if (ce->scl == 0xFFFFFFFF) res = FR_DISK_ERR;
+		if (res == FR_OK) res = change_bitmap(fs, ce->scl, ce->tcl, 1);	/* Mark the cluster block 'in use' */
+		if (res == FR_OK) {
+			ce->clst = ce->scl + ce->tcl; ce->rem = 0;
+		}
+	} else
+#endif
+	if (!ce->alloc) {
+		for (cnt = FF_EXPAND_STEP; cnt; cnt--) {	/* Find a contiguous cluster block */
+			n = get_fat(&fp->obj, ce->clst);
+			if (++ce->clst >= fs->n_fatent) ce->clst = 2;
+			if (n == 1) { res = FR_INT_ERR; break; }
+			if (n == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
+			if (n == 0) {	/* Is it a free cluster? */
+				if (++ce->ncl == ce->tcl) {	/* Found, start allocating on the next call */
+					ce->alloc = 1; ce->clst = ce->scl;
+					fs->last_clst = ce->scl + ce->tcl - 1;	/* Keep other allocations out of the block meanwhile */
+					break;
+				}
+			} else {
+				ce->scl = ce->clst; ce->ncl = 0;	/* Not a free cluster */
+			}
+			if (ce->clst == ce->stcl) { res = FR_DENIED; break; }	/* No contiguous cluster? */
+		}
+	} else if (ce->alloc == 1) {
+		for (cnt = FF_EXPAND_STEP; cnt && ce->rem; cnt--) {	/* Extend the cluster chain on the FAT */
+			n = get_fat(&fp->obj, ce->clst);	/* Others may have allocated since the search */
+			if (n == 1) { res = FR_INT_ERR; break; }
+			if (n == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
+			if (n != 0) {	/* Taken meanwhile, release the part linked so far and search again */
+				ce->alloc = 2;
+				break;
+			}
+			res = put_fat(fs, ce->clst, (ce->rem == 1) ? 0xFFFFFFFF : ce->clst + 1);
+			if (res != FR_OK) break;
+			ce->clst++; ce->rem--;
+		}
+	} else {
+		for (cnt = FF_EXPAND_STEP; cnt && ce->scl != ce->clst; cnt--) {	/* Release the partial chain */
+			res = put_fat(fs, ce->scl, 0);
+			if (res != FR_OK) break;
+			ce->scl++;
+		}
+		if (res == FR_OK && ce->scl == ce->clst) {	/* Released, search again past the taken cluster */
+			if (++ce->clst >= fs->n_fatent) ce->clst = 2;
+			ce->stcl = ce->scl = ce->clst; ce->ncl = 0;
+			ce->rem = ce->tcl;
+			ce->alloc = 0;
+		}
+	}
+
+	if (res == FR_OK && ce->rem == 0) {	/* Is the chain complete? */
+		fs->last_clst = ce->clst - 1;	/* Set suggested start cluster to start next */
+		fp->obj.sclust = ce->scl;		/* Update object allocation information */
+		fp->obj.objsize = ce->fsz;
+		if (FF_FS_EXFAT) fp->obj.stat = 2;	/* Set status 'contiguous chain' */
+		fp->flag |= FA_MODIFIED;
+		if (fs->free_clst <= fs->n_fatent - 2) {	/* Update FSINFO */
+			fs->free_clst -= ce->tcl;
+			fs->fsi_flag |= 1;
+		}
+	}
+
+	LEAVE_FF(fs, res);
+}
+
 #endif /* FF_USE_EXPAND && !FF_FS_READONLY */
 
 
 
+#if FF_WIN_CACHE && !FF_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* Get the Sector Cache Hit/Miss Counters                                */
+/*-----------------------------------------------------------------------*/
+
+void f_wincache_stats (
+	DWORD* hits,	/* Pointer to receive the number of window cache hits */
+	DWORD* misses	/* Pointer to receive the number of cacheable misses */
+)
+{
+	*hits = wc_hits;
+	*misses = wc_misses;
+}
+#endif
+
+
+
 #if FF_USE_FORWARD
 /*-----------------------------------------------------------------------*/
 /* Forward Data to the Stream Directly                                   */
@@ -306,11 +306,26 @@ typedef struct {
 	DWORD clst;			/* Current cluster number */
 	DWORD clsz;			/* Cluster size */
 	FSIZE_t fsz;		/* Remaining file size to check */
-	LBA_t seek;			/* The f_lseek() value for the next call */
+	FSIZE_t seek;		/* The f_lseek() value for the next call */
 	DWORD step;
 } FSCONTIG;
 
 
+/* Ongoing incremental expansion object (FSEXPAND) */
+
+typedef struct {
+	FIL* fp;			/* File being worked on */
+	FSIZE_t fsz;		/* File size to be expanded to */
+	DWORD stcl;			/* Cluster the search started from */
+	DWORD scl;			/* First cluster of the candidate block */
+	DWORD clst;			/* Next cluster to examine or allocate */
+	DWORD ncl;			/* Free clusters found so far in the candidate block */
+	DWORD tcl;			/* Number of clusters required */
+	DWORD rem;			/* Clusters left to allocate, 0 when complete */
+	BYTE alloc;			/* 0:Searching, 1:Allocating or 2:Releasing */
+} FSEXPAND;
+
+
 /*--------------------------------------------------------------*/
 /* FatFs module application interface                           */
 
@@ -328,6 +343,7 @@ FRESULT f_sync (FIL* fp);											/* Flush cached data of the writing file */
 FRESULT f_opendir (DIR* dp, const TCHAR* path);						/* Open a directory */
 FRESULT f_closedir (DIR* dp);										/* Close an open directory */
 FRESULT f_readdir (DIR* dp, FILINFO* fno);							/* Read a directory item */
+FRESULT f_openat (FIL* fp, DIR* dp, DWORD ofs);						/* Open a directory item for reading */
 FRESULT f_findfirst (DIR* dp, FILINFO* fno, const TCHAR* path, const TCHAR* pattern);	/* Find first file */
 FRESULT f_findnext (DIR* dp, FILINFO* fno);							/* Find next file */
 FRESULT f_mkdir (const TCHAR* path);								/* Create a sub directory */
@@ -344,6 +360,11 @@ FRESULT f_getlabel (const TCHAR* path, TCHAR* label, DWORD* vsn);	/* Get volume
 FRESULT f_setlabel (const TCHAR* label);							/* Set volume label */
 FRESULT f_forward (FIL* fp, UINT(*func)(const BYTE*,UINT), UINT btf, UINT* bf);	/* Forward data to the stream */
 FRESULT f_expand (FIL* fp, FSIZE_t fsz, BYTE opt);					/* Allocate a contiguous block to the file */
+FRESULT f_expand_setup (FIL* fp, FSIZE_t fsz, FSEXPAND* ce);		/* Sets up below call */
+FRESULT f_expand_step (FSEXPAND* ce);								/* Allocates part of a contiguous block */
+#if FF_WIN_CACHE && !FF_FS_READONLY
+void f_wincache_stats (DWORD* hits, DWORD* misses);					/* Get the sector cache hit/miss counters */
+#endif
 FRESULT f_mount (FATFS* fs, const TCHAR* path, BYTE opt);			/* Mount/Unmount a logical drive */
 FRESULT f_mkfs (const TCHAR* path, const MKFS_PARM* opt, void* work, UINT len);	/* Create a FAT volume */
 FRESULT f_fdisk (BYTE pdrv, const LBA_t ptbl[], void* work);		/* Divide a physical drive into some partitions */
@@ -41,6 +41,9 @@
 #define FF_USE_EXPAND	1
 /* This option switches f_expand function. (0:Disable or 1:Enable) */
 
+// scuznet change: number of clusters processed per f_expand_step() call
+#define FF_EXPAND_STEP	512
+
 
 #define FF_USE_CHMOD	0
 /* This option switches attribute manipulation functions, f_chmod() and f_utime().
@@ -235,6 +238,23 @@
 /  Instead of private sector buffer eliminated from the file object, common sector
 /  buffer in the filesystem object (FATFS) is used for the file data transfer. */
 
+// scuznet change: normally set by the Makefile memory profile, otherwise this
+// auto-sizes the FAT sector cache based on MCU SRAM
+#if !defined(FF_WIN_CACHE)
+	#include <avr/io.h>
+	#if INTERNAL_SRAM_SIZE >= 16384
+		#define FF_WIN_CACHE	8
+	#elif INTERNAL_SRAM_SIZE >= 8192
+		#define FF_WIN_CACHE	4
+	#else
+		#define FF_WIN_CACHE	0
+	#endif
+#endif
+/* Number of sectors from the system area (FATs and FAT12/16 root directory)
+/  kept in an LRU cache behind the window, each using FF_MAX_SS bytes of SRAM.
+/  Directories in the data area (all of them on FAT32 and exFAT) are not
+/  cached. 0 disables the cache. */
+
 // scuznet change: this auto-toggles exFAT support based on MCU memory capacity
 #if defined(USE_EXFAT)
 	#define FF_FS_EXFAT		1
@@ -19,7 +19,9 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <util/delay.h>
+#include <util/delay_basic.h>
 #include "config.h"
 #include "debug.h"
 #include "link.h"
@@ -113,16 +115,89 @@ static uint8_t asked_for_reselection = 0;
 // the dynamically configured MAC address
 static uint8_t mac_dyn[6];
 
+/*
+ * The multicast addresses the driver asked for. The ENC28J60 hash filter lets
+ * through any frame whose address hashes the same as one of these, so frames
+ * it accepts are checked against this list before being handed over. When
+ * the count is LINK_MCAST_ALL, every multicast frame is wanted.
+ */
+#define LINK_MCAST_MAX          8
+#define LINK_MCAST_ALL          255
+static uint8_t mcast_list[LINK_MCAST_MAX][6];
+static uint8_t mcast_count = LINK_MCAST_ALL;
+
+/*
+ * Counters for the received protocol allow list: how many packets each entry
+ * has let through, and how many were dropped, by the kind of frame they were.
+ */
+#define LINK_FRAME_ETHERNET     0  // Ethernet II
+#define LINK_FRAME_SNAP         1  // 802.2 with a SNAP header
+#define LINK_FRAME_SAP          2  // other 802.2
+static uint32_t allow_hits[LINK_ALLOW_MAX];
+static uint32_t allow_drops[3];
+
+// bytes at the start of a packet needed to check it against the filters: the
+// MAC header, then the 802.2 LLC and SNAP headers if present
+#define LINK_PEEK_LENGTH        22
+
+/*
+ * Token bucket for limiting broadcast and multicast packets. Tokens are kept
+ * in units of 1/1024 of a packet, which makes each tick of the uptime clock
+ * worth the configured packets per second.
+ */
+#define LINK_LIMIT_UNIT         1024
+#define LINK_LIMIT_REFILL       1024 // uptime ticks between idle refills
+static uint32_t limit_tokens;
+static uint16_t limit_time;
+static uint32_t limit_drops;
+
+/*
+ * Remaining receive counters, for the statistics commands: packets handed to
+ * the initiator, how many of those were cut short, and multicast packets that
+ * only got through the hash filter by accident. The rest are in net_stats.
+ */
+static uint32_t rx_delivered;
+static uint32_t rx_truncated;
+static uint32_t mcast_drops;
+
+// number of counters reported by the vendor statistics command
+#define LINK_STATS_COUNT        (15 + LINK_ALLOW_MAX)
+
+// the AppleTalk broadcast address, the only one the Nuvolink driver uses
+static const __flash uint8_t mcast_appletalk[] = {
+	0x09, 0x00, 0x07, 0xFF, 0xFF, 0xFF
+};
+
 /*
  * Used to moderate the response to Dayna polling when emulating that device.
  * If the system responds too fast to a sent packet, the driver can become
- * confused. This value is set non-zero after a packet is sent, which prevents
- * the next poll from returning data: instead, the poll just resets the flag.
+ * confused. This value is set to the configured throttle after a packet is
+ * sent, and that many polls then do not return data, counting it back down.
  * Polling happens fast enough under their system that this shouldn't have a
  * major impact on performance.
  */
 static uint8_t dayna_wait = 0;
 
+/*
+ * The pause between the Dayna packet header and its data, in microseconds.
+ * When the delay is set to be found automatically this starts at a value
+ * known to work and is stepped down after each run of clean reads, never
+ * going below the configured minimum. A read the driver mishandles is judged
+ * by what it does next: cutting the transfer short, or not polling again for
+ * a while afterward, which is how it behaves once a packet has confused it.
+ * The delay is then backed off and left alone.
+ */
+static uint8_t dayna_delay;
+static uint8_t dayna_calibrating = 0;
+static uint8_t dayna_clean_reads = 0;
+static uint8_t dayna_checking = 0;
+static uint16_t dayna_sent_time;
+#define DAYNA_DELAY_START       100
+#define DAYNA_DELAY_STEP        10
+#define DAYNA_DELAY_MARGIN      20
+#define DAYNA_DELAY_READS       64
+#define DAYNA_POLL_LATE         1024 // uptime ticks, about one second
+
 /*
  * ============================================================================
  *   UTILITY FUNCTIONS
@@ -130,6 +205,282 @@ static uint8_t dayna_wait = 0;
  */
 
 
+/*
+ * Busy-waits for the given number of microseconds. _delay_us() needs a value
+ * known at compile time, so this uses the four cycle loop underneath it.
+ */
+static void link_delay_us(uint8_t us)
+{
+	if (us > 0)
+	{
+		_delay_loop_2((uint16_t) us * (F_CPU / 4000000UL));
+	}
+}
+
+/*
+ * Updates the automatic Dayna header delay once the outcome of a packet read
+ * by the initiator is known, given whether it had problems.
+ */
+static void link_dayna_calibrate(uint8_t failed)
+{
+	if (! dayna_calibrating) return;
+
+	if (failed)
+	{
+		// the last step went too far; back off with some room to spare
+		dayna_delay += DAYNA_DELAY_MARGIN;
+		if (dayna_delay > DAYNA_DELAY_START) dayna_delay = DAYNA_DELAY_START;
+		dayna_calibrating = 0;
+		debug_dual(DEBUG_LINK_DELAY_CALIBRATED, dayna_delay);
+	}
+	else if (++dayna_clean_reads >= DAYNA_DELAY_READS)
+	{
+		dayna_clean_reads = 0;
+		if (dayna_delay >= config_enet.delay_min + DAYNA_DELAY_STEP)
+		{
+			dayna_delay -= DAYNA_DELAY_STEP;
+		}
+		else
+		{
+			// the driver is happy down to the configured minimum
+			dayna_delay = config_enet.delay_min;
+			dayna_calibrating = 0;
+			debug_dual(DEBUG_LINK_DELAY_CALIBRATED, dayna_delay);
+		}
+	}
+}
+
+/*
+ * Called as each Dayna read command arrives. If a packet was delivered since
+ * the last one and link_check_time() has not already found the poll to be
+ * late, the packet was handled fine.
+ */
+static void link_dayna_poll(void)
+{
+	if (! dayna_checking) return;
+	dayna_checking = 0;
+	link_dayna_calibrate(0);
+}
+
+/*
+ * Checks the destination of a multicast packet against the addresses the
+ * driver asked for, given the start of the packet.
+ */
+static uint8_t link_rx_mcast_match(uint8_t* head)
+{
+	for (uint8_t i = 0; i < mcast_count; i++)
+	{
+		if (! memcmp(head, mcast_list[i], 6)) return 1;
+	}
+	return 0;
+}
+
+/*
+ * Checks the protocol of a packet against the allow list, given the start of
+ * the packet, and updates the counters.
+ */
+static uint8_t link_rx_allowed(uint8_t* head)
+{
+	uint8_t kind;
+	uint16_t type = (head[12] << 8) | head[13];
+	if (type >= 0x0600)
+	{
+		kind = LINK_FRAME_ETHERNET;
+	}
+	else if (head[14] == 0xAA && head[15] == 0xAA && head[16] == 0x03)
+	{
+		kind = LINK_FRAME_SNAP;
+		type = (head[20] << 8) | head[21];
+	}
+	else
+	{
+		kind = LINK_FRAME_SAP;
+		type = head[14];
+	}
+
+	for (uint8_t i = 0; i < config_enet.allow_count; i++)
+	{
+		uint16_t rule = config_enet.allow[i];
+		if (rule == type && (rule < 0x0100) == (kind == LINK_FRAME_SAP))
+		{
+			allow_hits[i]++;
+			return 1;
+		}
+	}
+	allow_drops[kind]++;
+	return 0;
+}
+
+/*
+ * Adds the tokens earned since the last refill to the rate limiter. This is
+ * also done regularly from link_check_time(), so the time since the last
+ * refill never gets near the point where the uptime clock wraps.
+ */
+static void link_rx_refill(void)
+{
+	uint16_t now = debug_uptime();
+	uint16_t elapsed = now - limit_time;
+	limit_time = now;
+
+	uint32_t cap = (uint32_t) config_enet.burst * LINK_LIMIT_UNIT;
+	limit_tokens += (uint32_t) elapsed * config_enet.limit;
+	if (limit_tokens > cap) limit_tokens = cap;
+}
+
+/*
+ * Takes a token from the broadcast and multicast rate limiter, returning
+ * false if the packet is over the limit.
+ */
+static uint8_t link_rx_limit(void)
+{
+	link_rx_refill();
+	if (limit_tokens < LINK_LIMIT_UNIT)
+	{
+		limit_drops++;
+		return 0;
+	}
+	limit_tokens -= LINK_LIMIT_UNIT;
+	return 1;
+}
+
+/*
+ * Checks whether the pending packet is one the initiator asked for, is for a
+ * protocol on the allow list, and is within the broadcast rate limit.
+ */
+static uint8_t link_rx_wanted(void)
+{
+	// only multicast frames (not broadcasts) can be false hash matches
+	uint8_t mcast = (net_header.stath & 3) == 0x01
+			&& mcast_count != LINK_MCAST_ALL;
+	if (mcast || config_enet.allow_count > 0)
+	{
+		uint8_t head[LINK_PEEK_LENGTH];
+		memset(head, 0, LINK_PEEK_LENGTH);
+		if (net_peek(head, LINK_PEEK_LENGTH) == NETSTAT_NO_DATA) return 0;
+
+		if (mcast && ! link_rx_mcast_match(head))
+		{
+			mcast_drops++;
+			return 0;
+		}
+		if (config_enet.allow_count > 0 && ! link_rx_allowed(head)) return 0;
+	}
+
+	// the limit is checked last so only packets otherwise wanted use it up
+	if ((net_header.stath & 3) && config_enet.limit > 0)
+	{
+		return link_rx_limit();
+	}
+	return 1;
+}
+
+/*
+ * Updates the counters after a packet has been handed to the initiator.
+ */
+static void link_rx_count(NETSTAT res)
+{
+	rx_delivered++;
+	if (res == NETSTAT_TRUNCATED)
+	{
+		rx_truncated++;
+	}
+}
+
+#ifdef USE_TOOLBOX
+/*
+ * Provides the statistics counter with the given index:
+ * 
+ * 0:      packets received
+ * 1:      packets handed to the initiator
+ * 2:      packets handed over but cut short
+ * 3:      multicast packets not asked for
+ * 4:      broadcast and multicast packets over the rate limit
+ * 5:      receive buffer overflows
+ * 6:      receive packet count overflows
+ * 7:      packets sent
+ * 8:      retransmissions after errors
+ * 9:      retransmissions after timeouts
+ * 10-12:  packets not on the allow list (Ethernet II, SNAP, other 802.2)
+ * 13-20:  packets let through by each allow list entry
+ * 21:     most receive buffer bytes in use at once
+ * 22:     most packet headers queued at once
+ */
+static uint32_t link_stats_value(uint8_t idx)
+{
+	switch (idx)
+	{
+		case 0: return net_stats.rx_frames;
+		case 1: return rx_delivered;
+		case 2: return rx_truncated;
+		case 3: return mcast_drops;
+		case 4: return limit_drops;
+		case 5: return net_stats.rx_overflow;
+		case 6: return net_stats.rx_full;
+		case 7: return net_stats.tx_ok;
+		case 8: return net_stats.tx_retry;
+		case 9: return net_stats.tx_timeout;
+	}
+	if (idx < 13) return allow_drops[idx - 10];
+	if (idx < 13 + LINK_ALLOW_MAX) return allow_hits[idx - 13];
+	if (idx == 13 + LINK_ALLOW_MAX) return net_stats.rx_peak;
+	if (idx == 14 + LINK_ALLOW_MAX) return net_stats.queue_peak;
+	return 0;
+}
+
+#endif
+
+/*
+ * Clears all statistics counters.
+ */
+static void link_stats_reset(void)
+{
+	memset(&net_stats, 0, sizeof(NetStats));
+	memset(allow_hits, 0, sizeof(allow_hits));
+	memset(allow_drops, 0, sizeof(allow_drops));
+	limit_drops = 0;
+	rx_delivered = 0;
+	rx_truncated = 0;
+	mcast_drops = 0;
+}
+
+/*
+ * Sends a counter to the initiator, most significant byte first.
+ */
+static void link_offer_dword(uint32_t value)
+{
+	phy_data_offer((uint8_t) (value >> 24));
+	phy_data_offer((uint8_t) (value >> 16));
+	phy_data_offer((uint8_t) (value >> 8));
+	phy_data_offer((uint8_t) value);
+}
+
+/*
+ * Drops pending packets that the initiator does not want, so they never cross
+ * the bus, and returns whether there is a wanted packet pending afterwards.
+ * This should be used instead of net_pending() when deciding whether to hand
+ * a packet over.
+ */
+static uint8_t link_rx_pending(void)
+{
+	while (net_pending())
+	{
+		// each packet is only checked once, as that updates the counters
+		if (NET_FLAGS & NETFLAG_PKT_CHECKED) return 1;
+		if (link_rx_wanted())
+		{
+			NET_FLAGS |= NETFLAG_PKT_CHECKED;
+			return 1;
+		}
+
+		debug(DEBUG_LINK_RX_FILTERED);
+		net_skip();
+
+		// if there is another packet, its header is only microseconds away
+		while (! net_pending() && enc_is_int_asserted());
+	}
+	return 0;
+}
+
 static void link_send_packet(uint16_t length)
 {
 	if (length > MAXIMUM_TRANSFER_LENGTH)
@@ -138,8 +489,10 @@ static void link_send_packet(uint16_t length)
 	}
 
 	phy_phase(PHY_PHASE_DATA_OUT);
-	net_stream_write(phy_data_ask_stream, length);
-	net_transmit(length);
+	if (net_stream_write(phy_data_ask_bulk, length) == NETSTAT_OK)
+	{
+		net_transmit(length);
+	}
 }
 
 /*
@@ -236,20 +589,29 @@ static void link_cmd_inquiry(uint8_t* cmd)
 			{
 				phy_data_offer(0x00);
 			}
-			// network statistics
+			// network statistics: received, sent, handed over
 			phy_data_offer(0x0D);
 			phy_data_offer(0x80);
-			for (uint8_t i = 0; i < 14; i++)
-			{
-				phy_data_offer(0x00);
-			}
-			// network errors
+			link_offer_dword(net_stats.rx_frames);
+			link_offer_dword(net_stats.tx_ok);
+			link_offer_dword(rx_delivered);
+			phy_data_offer(0x00);
+			phy_data_offer(0x00);
+			// network errors: buffer overflows, packet count overflows,
+			// truncations, filtered, rate limited, TX retries, TX timeouts
 			phy_data_offer(0x11);
 			phy_data_offer(0xD7);
-			for (uint8_t i = 0; i < 30; i++)
-			{
-				phy_data_offer(0x00);
-			}
+			link_offer_dword(net_stats.rx_overflow);
+			link_offer_dword(net_stats.rx_full);
+			link_offer_dword(rx_truncated);
+			link_offer_dword(mcast_drops + allow_drops[LINK_FRAME_ETHERNET]
+					+ allow_drops[LINK_FRAME_SNAP]
+					+ allow_drops[LINK_FRAME_SAP]);
+			link_offer_dword(limit_drops);
+			link_offer_dword(net_stats.tx_retry);
+			link_offer_dword(net_stats.tx_timeout);
+			phy_data_offer(0x00);
+			phy_data_offer(0x00);
 		}
 	}
 	else if (config_enet.type == LINK_DAYNA)
@@ -304,12 +666,52 @@ static void link_cmd_dayna_statistics(uint8_t* cmd)
 
 	phy_phase(PHY_PHASE_DATA_IN);
 
-	// send MAC, then 3x DWORD 0x0 values
+	/*
+	 * Send MAC, then 3x DWORD values: frame alignment errors, CRC errors,
+	 * and frames lost. The ENC28J60 silently discards frames with the first
+	 * two, so those are unknown. Frames lost are receive buffer overflows,
+	 * packets cut short, and packets dropped by the broadcast rate limit.
+	 */
 	phy_data_offer_bulk(mac_dyn, 6);
-	for (uint8_t i = 0; i < 12; i++)
+	for (uint8_t i = 0; i < 8; i++)
 	{
 		phy_data_offer(0x00);
 	}
+	link_offer_dword(net_stats.rx_overflow + net_stats.rx_full
+			+ rx_truncated + limit_drops);
+
+	if (phy_is_atn_asserted())
+	{
+		logic_message_out();
+	}
+	logic_status(LOGIC_STATUS_GOOD);
+	logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+}
+
+#ifdef USE_TOOLBOX
+/*
+ * Vendor-specific command reporting all statistics counters, in the order
+ * given by link_stats_value(). If bit 0 of byte 1 is set, the counters are
+ * cleared after being sent.
+ */
+static void link_cmd_statistics(uint8_t* cmd)
+{
+	uint16_t alloc = (cmd[7] << 8) + cmd[8];
+	if (alloc > LINK_STATS_COUNT * 4) alloc = LINK_STATS_COUNT * 4;
+
+	if (alloc > 0)
+	{
+		phy_phase(PHY_PHASE_DATA_IN);
+		for (uint8_t i = 0; i < (uint8_t) alloc; i++)
+		{
+			uint32_t value = link_stats_value(i >> 2);
+			phy_data_offer((uint8_t) (value >> ((3 - (i & 3)) << 3)));
+		}
+	}
+	if (cmd[1] & 1)
+	{
+		link_stats_reset();
+	}
 
 	if (phy_is_atn_asserted())
 	{
@@ -318,6 +720,7 @@ static void link_cmd_dayna_statistics(uint8_t* cmd)
 	logic_status(LOGIC_STATUS_GOOD);
 	logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
 }
+#endif
 
 static void link_cmd_nuvo_filter(uint8_t* cmd)
 {
@@ -355,6 +758,7 @@ static void link_cmd_nuvo_filter(uint8_t* cmd)
 		for (uint8_t i = 0; i < 8; i++) debug(data[i]);
 
 		// fallback to accepting all multicast
+		mcast_count = LINK_MCAST_ALL;
 		net_set_filter(NET_FILTER_UNICAST
 					| NET_FILTER_BROADCAST
 					| NET_FILTER_MULTICAST);
@@ -367,6 +771,11 @@ static void link_cmd_nuvo_filter(uint8_t* cmd)
 		{
 			// corresponds to 09:00:07:FF:FF:FF for the ENC28J60
 			net_hash_filter_set(7, 0x02);
+			for (uint8_t i = 0; i < 6; i++)
+			{
+				mcast_list[0][i] = mcast_appletalk[i];
+			}
+			mcast_count = 1;
 			uint8_t filter = NET_FILTER_UNICAST
 					| NET_FILTER_BROADCAST
 					| NET_FILTER_HASH;
@@ -395,7 +804,9 @@ static void link_cmd_dayna_filter(uint8_t* cmd)
 	 * 
 	 * The provided addresses are fed into the hash table filter, which
 	 * unfortunately accepts all packets matching the filter, not just
-	 * multicast packets.
+	 * multicast packets. They are also kept in mcast_list so the extra
+	 * packets can be dropped before the driver is told about them. If there
+	 * are too many to keep, all hash matches are accepted instead.
 	 */
 
 	uint16_t alloc = (cmd[3] << 8) + cmd[4];
@@ -403,6 +814,7 @@ static void link_cmd_dayna_filter(uint8_t* cmd)
 	uint8_t fp = 0;
 
 	net_hash_filter_reset(); // clear out old information
+	mcast_count = 0;
 
 	phy_phase(PHY_PHASE_DATA_OUT);
 	for (uint16_t i = 0; i < alloc; i++)
@@ -411,6 +823,14 @@ static void link_cmd_dayna_filter(uint8_t* cmd)
 		if (fp == 6)
 		{
 			net_hash_filter_add(filter);
+			if (mcast_count < LINK_MCAST_MAX)
+			{
+				memcpy(mcast_list[mcast_count++], filter, 6);
+			}
+			else
+			{
+				mcast_count = LINK_MCAST_ALL;
+			}
 			fp = 0;
 		}
 	}
@@ -452,7 +872,7 @@ static void link_cmd_dayna_send(uint8_t* cmd)
 	link_send_packet(length);
 	if (! net_pending())
 	{
-		dayna_wait = 1;
+		dayna_wait = config_enet.throttle;
 	}
 
 	if (cmd[5] == 0x80)
@@ -485,7 +905,8 @@ static void link_nuvo_read_packet(void)
 
 	phy_phase(PHY_PHASE_DATA_IN);
 	phy_data_offer_bulk(read_buffer, 4);
-	NETSTAT res = net_stream_read(phy_data_offer_stream_atn);
+	NETSTAT res = net_stream_read(phy_data_offer_bulk_atn);
+	link_rx_count(res);
 	if (res)
 	{
 		debug_dual(DEBUG_LINK_RX_PACKET_TRUNCATED, res);
@@ -570,8 +991,98 @@ static uint16_t link_nuvo_message_out_post_rx(void)
 	}
 }
 
+static void link_dayna_read_packet(uint16_t allocation)
+{
+	uint8_t read_buffer[6];
+
+	/*
+	 * Never send more than the driver said it can read (although this always
+	 * seems to be 0x05F4 which is 1524 which is 1518 + the 6 driver preamble
+	 * bytes). A packet that does not fit is cut short, and counted that way.
+	 */
+	uint8_t clamped = 0;
+	if (net_header.length + 6 > allocation)
+	{
+		net_header.length = (allocation > 6) ? allocation - 6 : 0;
+		clamped = 1;
+	}
+
+	/*
+	 * Move the length bytes into the correct position. The length
+	 * bytes for both Daynaport and Nuvolink seem to be the same -
+	 * length of the payload excluding length and flag bytes, except
+	 * little endian vs big endian.
+	 */
+	read_buffer[0] = (uint8_t) ((net_header.length) >> 8);
+	read_buffer[1] = (uint8_t) (net_header.length);
+	read_buffer[2] = 0x00;
+	read_buffer[3] = 0x00;
+	read_buffer[4] = 0x00;
+
+	/*
+	 * Flagging another byte as waiting does make a big difference in
+	 * transfer speeds (5.4mb FILE 3:03 VS 3:35). Per the driver docs,
+	 * a 0x10 means there is another packet ready to be read.
+	 * Presumably this means the driver doesn't just wait for it's
+	 * polling interval to elapse before asking for another packet.
+	 */
+	if (net_queued() > 1 || enc_is_int_asserted())
+	{
+		read_buffer[5] = 0x10;
+	}
+	else
+	{
+		read_buffer[5] = 0x00;
+	}
+
+	// send the header
+	for (uint8_t i = 0; i < 6; i++)
+	{
+		phy_data_offer(read_buffer[i]);
+	}
+
+	/*
+	 * This pause necessary for the driver to properly read the
+	 * packets. It might need to have time to parse the length out
+	 * before reading the rest of it. 30us - 60us seemed to work
+	 * reliably on my SE/30.  The SE did not work with 40 or 60 but
+	 * did with 100. Faster machines may need less, so this is
+	 * configurable, or can be found automatically.
+	 */
+	link_delay_us(dayna_delay);
+
+	// send data; a cut-short transfer means the delay was too short, and
+	// otherwise the next poll decides
+	NETSTAT res = net_stream_read(phy_data_offer_bulk);
+	link_rx_count(clamped ? NETSTAT_TRUNCATED : res);
+	if (res != NETSTAT_OK)
+	{
+		dayna_checking = 0;
+		link_dayna_calibrate(1);
+	}
+	else if (dayna_calibrating)
+	{
+		dayna_checking = 1;
+		dayna_sent_time = debug_uptime();
+	}
+}
+
+/*
+ * Used in batch mode after a packet has been sent to see if another can
+ * follow it in the same GET MESSAGE. If the ENC28J60 has another packet, this
+ * waits the few microseconds it takes for the ISRs to fetch its header, then
+ * checks that it will fit in the given remaining allocation.
+ */
+static uint8_t link_dayna_next_fits(uint16_t remaining)
+{
+	while (! net_pending() && enc_is_int_asserted());
+	if (! link_rx_pending()) return 0;
+	return net_header.length + 6 <= remaining;
+}
+
 static void link_cmd_dayna_read(uint8_t* cmd)
 {
+	link_dayna_poll();
 	uint16_t allocation = ((cmd[3]) << 8) + cmd[4];
 	if (allocation == 1)
 	{
@@ -581,7 +1092,7 @@ static void link_cmd_dayna_read(uint8_t* cmd)
 		return;
 	}
 
-	if (dayna_wait || ! net_pending())
+	if (dayna_wait || ! link_rx_pending())
 	{
 		// send "No Packets" message
 		// debug(DEBUG_LINK_RX_NO_DATA);
@@ -590,75 +1101,26 @@ static void link_cmd_dayna_read(uint8_t* cmd)
 		{
 			phy_data_offer(0x00);
 		}
-		dayna_wait = 0;
+		if (dayna_wait) dayna_wait--;
 	}
 	else
 	{
-		uint8_t read_buffer[6];
 		debug(DEBUG_LINK_RX_STARTING);
+		phy_phase(PHY_PHASE_DATA_IN);
 
 		/*
-		 * Move the length bytes into the correct position. The length
-		 * bytes for both Daynaport and Nuvolink seem to be the same -
-		 * length of the payload excluding length and flag bytes, except
-		 * little endian vs big endian.
-		 */
-		read_buffer[0] = (uint8_t) ((net_header.length) >> 8);
-		read_buffer[1] = (uint8_t) (net_header.length);
-		read_buffer[2] = 0x00;
-		read_buffer[3] = 0x00;
-		read_buffer[4] = 0x00;
-
-		/*
-		 * Flagging another byte as waiting does make a big difference in
-		 * transfer speeds (5.4mb FILE 3:03 VS 3:35). Per the driver docs,
-		 * a 0x10 means there is another packet ready to be read.
-		 * Presumably this means the driver doesn't just wait for it's
-		 * polling interval to elapse before asking for another packet.
-		 */
-		if (enc_is_int_asserted())
-		{
-			read_buffer[5] = 0x10;
-		}
-		else
-		{
-			read_buffer[5] = 0x00;
-		}
-
-		/*
-		 * Ensure data length isn't more than the amount the driver
-		 * said it can read (although this always seems to be 0x05F4
-		 * which is 1524 which is 1518 + the 6 driver preamble bytes)
-		 * 
-		 * TODO HANDLE THIS CONDITION
+		 * Send the pending packet. In batch mode, keep going with any others
+		 * that are waiting as long as they fit entirely in what is left of
+		 * the allocation.
 		 */
-/*		uint16_t 
-		if (net_header.length > allocation - 6)
-		{
-			net_header.length = allocation - 6;
-		}
-*/
-
-		phy_phase(PHY_PHASE_DATA_IN);
-		// send the header
-		for (uint8_t i = 0; i < 6; i++)
+		uint16_t remaining = allocation;
+		do
 		{
-			phy_data_offer(read_buffer[i]);
+			uint16_t used = net_header.length + 6;
+			link_dayna_read_packet(remaining);
+			remaining = (used < remaining) ? remaining - used : 0;
 		}
-
-		/*
-		 * This pause necessary for the driver to properly read the
-		 * packets. It might need to have time to parse the length out
-		 * before reading the rest of it. 30us - 60us seemed to work
-		 * reliably on my SE/30.  The SE did not work with 40 or 60 but
-		 * did with 100.  There doesn't seem to be an significant
-		 * performance penalty but there is a significant increase in
-		 * compatibility.
-		 */
-		_delay_us(100);
-
-		// send data
-		net_stream_read(phy_data_offer_stream);
+		while (config_enet.batch && link_dayna_next_fits(remaining));
 	}
 
 	// Close out transaction
@@ -685,6 +1147,21 @@ void link_init()
 		{
 			mac_dyn[i] = config_enet.mac[i];
 		}
+		if (config_enet.delay == LINK_DELAY_AUTO
+				&& config_enet.delay_min < DAYNA_DELAY_START)
+		{
+			dayna_delay = DAYNA_DELAY_START;
+			dayna_calibrating = 1;
+		}
+		else if (config_enet.delay == LINK_DELAY_AUTO)
+		{
+			// nothing left to search between the start and the minimum
+			dayna_delay = config_enet.delay_min;
+		}
+		else
+		{
+			dayna_delay = config_enet.delay;
+		}
 		net_set_filter(NET_FILTER_UNICAST | NET_FILTER_BROADCAST);
 	}
 	else
@@ -705,7 +1182,7 @@ void link_check_rx(void)
 		return;
 	}
 
-	if (net_pending())
+	if (link_rx_pending())
 	{
 		if (last_identify & 0x40)
 		{
@@ -725,6 +1202,26 @@ void link_check_rx(void)
 	}
 }
 
+void link_check_time(void)
+{
+	/*
+	 * The uptime clock wraps about once a minute, so a late poll is caught
+	 * here as soon as it is late rather than measured when it finally comes.
+	 */
+	if (dayna_checking
+			&& (uint16_t) (debug_uptime() - dayna_sent_time) > DAYNA_POLL_LATE)
+	{
+		dayna_checking = 0;
+		link_dayna_calibrate(1);
+	}
+
+	if (config_enet.limit > 0
+			&& (uint16_t) (debug_uptime() - limit_time) > LINK_LIMIT_REFILL)
+	{
+		link_rx_refill();
+	}
+}
+
 uint8_t link_main(void)
 {
 	if (! logic_ready()) return 0;
@@ -760,7 +1257,7 @@ uint8_t link_main(void)
 		 * disconnect ourselves.
 		 */
 		uint16_t txreq = 0;
-		while (phy_is_active() && (net_pending() || txreq))
+		while (phy_is_active() && (link_rx_pending() || txreq))
 		{
 			if (txreq)
 			{
@@ -811,7 +1308,7 @@ uint8_t link_main(void)
 			switch (cmd[0])
 			{
 				case 0x02: // "Reset Stats"
-					// at the moment, we have no stats to reset
+					link_stats_reset();
 					logic_status(LOGIC_STATUS_GOOD);
 					logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
 					break;
@@ -838,6 +1335,11 @@ uint8_t link_main(void)
 				case 0x1D: // SEND DIAGNOSTIC
 					link_cmd_send_diagnostic(cmd);
 					break;
+#ifdef USE_TOOLBOX
+				case 0xD9: // statistics (vendor specific)
+					link_cmd_statistics(cmd);
+					break;
+#endif
 				case 0x00: // TEST UNIT READY
 				case 0x08: // GET MESSAGE(6)
 				case 0x0A: // SEND MESSAGE(6)
@@ -891,6 +1393,11 @@ uint8_t link_main(void)
 				case 0x12: // INQUIRY
 					link_cmd_inquiry(cmd);
 					break;
+#ifdef USE_TOOLBOX
+				case 0xD9: // statistics (vendor specific)
+					link_cmd_statistics(cmd);
+					break;
+#endif
 				case 0x00: // TEST UNIT READY
 					logic_status(LOGIC_STATUS_GOOD);
 					logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
@@ -50,6 +50,23 @@
  * SEND DIAGNOSTIC      (0x1D)
  */
 
+/*
+ * Value for the Dayna header delay setting that has it found automatically,
+ * instead of being a fixed number of microseconds.
+ */
+#define LINK_DELAY_AUTO 255
+
+/*
+ * Maximum number of entries in the received protocol allow list.
+ */
+#define LINK_ALLOW_MAX  8
+
+/*
+ * Largest broadcast and multicast rate limit that can be set, in packets per
+ * second.
+ */
+#define LINK_LIMIT_MAX  10000
+
 /*
  * Defines the supported link emulation types.
  */
@@ -81,6 +98,12 @@ void link_init(void);
  */
 void link_check_rx(void);
 
+/*
+ * Should be called frequently from the main loop, to act on time passing for
+ * the emulated adapters even when the initiator is not talking to them.
+ */
+void link_check_time(void);
+
 /*
  * Called whenever the PHY detects that the link device has been selected, or
  * has managed to make a reconnection to the initiator. This will proceed
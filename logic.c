@@ -22,6 +22,7 @@
 #include "init.h"
 #include "logic.h"
 #include "phy.h"
+#include "toolbox.h"
 
 /*
  * Generic NO SENSE response for REQUEST SENSE when there is nothing to report.
@@ -128,7 +129,8 @@ uint8_t logic_sense_valid(void)
 
 uint8_t logic_parse_data_op(uint8_t* cmd, LogicDataOp* op)
 {
-	if (cmd[0] == 0x28 || cmd[0] == 0x2A || cmd[0] == 0x2B)
+	if (cmd[0] == 0x28 || cmd[0] == 0x2A || cmd[0] == 0x2B
+			|| cmd[0] == 0x2E || cmd[0] == 0x2F || cmd[0] == 0x34)
 	{
 		if (cmd[1] & 1)
 		{
@@ -324,7 +326,8 @@ uint8_t logic_command(uint8_t* command)
 		cmd_count = 10;
 	}
 #ifdef USE_TOOLBOX
-	else if (command[0] >= 0xD0 && command[0] <= 0xD2) // toolbox
+	else if (command[0] >= TOOLBOX_OP_FIRST
+			&& command[0] <= TOOLBOX_OP_LAST) // toolbox
 	{
 		cmd_count = 10;
 	}
@@ -353,7 +356,8 @@ uint8_t logic_command(uint8_t* command)
 		lun = command[1] >> 5;
 	}
 #ifdef USE_TOOLBOX
-	else if (command[0] >= 0xD0 && command[0] <= 0xD2)
+	else if (command[0] >= TOOLBOX_OP_FIRST
+			&& command[0] <= TOOLBOX_OP_LAST)
 	{
 		lun = 0;
 	}
@@ -388,7 +392,9 @@ uint8_t logic_command(uint8_t* command)
 
 	// command op out of range handler
 #ifdef USE_TOOLBOX
-	if (! (command[0] < 0x60 || (command[0] >= 0xD0 && command[0] <= 0xD2)))
+	if (! (command[0] < 0x60
+			|| (command[0] >= TOOLBOX_OP_FIRST
+				&& command[0] <= TOOLBOX_OP_LAST)))
 #else
 	if (! (command[0] < 0x60))
 #endif
@@ -606,6 +612,18 @@ void logic_request_sense(uint8_t* cmd)
 			sense_data[12] = 0x04;
 			sense_data[13] = 0x01;
 			break;
+		case SENSE_MEDIUM_CHANGED:
+			sense_data[2] = 0x06;
+			sense_data[12] = 0x28;
+			break;
+		case SENSE_MISCOMPARE:
+			sense_data[2] = 0x0E;
+			sense_data[3] = devices[device_id].value >> 24;
+			sense_data[4] = devices[device_id].value >> 16;
+			sense_data[5] = devices[device_id].value >> 8;
+			sense_data[6] = devices[device_id].value;
+			sense_data[12] = 0x1D;
+			break;
 		default:
 			// fallback to generic hardware error
 			// TODO: may want to debug this one
@@ -70,6 +70,10 @@
  * SENSE_MEDIUM_ERROR: an unspecified medium error; can provide anything.
  * SENSE_MEDIUM_ERROR: an unspecified hardware error; can provide anything.
  * SENSE_BECOMING_READY: device not yet ready; can provide anything.
+ * SENSE_MEDIUM_CHANGED: unit attention after the medium was changed; can
+ *     provide anything.
+ * SENSE_MISCOMPARE: data from the initiator did not match the medium during a
+ *     VERIFY; provide the byte offset of the first difference.
  */
 typedef enum {
 	SENSE_OK,
@@ -79,12 +83,14 @@ typedef enum {
 	SENSE_ILLEGAL_LBA,
 	SENSE_MEDIUM_ERROR,
 	SENSE_HARDWARE_ERROR,
-	SENSE_BECOMING_READY
+	SENSE_BECOMING_READY,
+	SENSE_MEDIUM_CHANGED,
+	SENSE_MISCOMPARE
 } SENSEDATA;
 
 /*
  * Stores 32 bit LBA and transfer length from a READ(6), READ(10), WRITE(6),
- * or WRITE(10) command.
+ * WRITE(10), or VERIFY-type command.
  */
 typedef struct LogicDataOp_t {
 	uint32_t lba;
@@ -178,9 +184,9 @@ uint8_t logic_identify(void);
 uint8_t logic_sense_valid(void);
 
 /*
- * Parses the LBA and transfer length from a READ(6), READ(10), WRITE(6), or
- * WRITE(10) command using the given CDB array and stores the result in the
- * given struct.
+ * Parses the LBA and transfer length from a READ(6), READ(10), WRITE(6),
+ * WRITE(10), SEEK, VERIFY, WRITE AND VERIFY, or PRE-FETCH command using the
+ * given CDB array and stores the result in the given struct.
  * 
  * This will return nonzero on success and zero on failure. On failure, sense
  * data will already be set.
@@ -35,6 +35,7 @@
 static FATFS fs;
 static uint8_t exec_count = 0;
 static uint16_t stack_unused = 0xFFFF;
+static uint8_t first_selection = 1;
 
 static void main_handle(void)
 {
@@ -43,6 +44,16 @@ static void main_handle(void)
 		uint8_t searching = 1;
 
 		led_on();
+		if (first_selection)
+		{
+			first_selection = 0;
+			if (debug_enabled())
+			{
+				uint16_t uptime = debug_uptime();
+				debug(DEBUG_MAIN_FIRST_SELECTION);
+				debug_dual((uint8_t) (uptime >> 8), (uint8_t) uptime);
+			}
+		}
 		uint8_t target = phy_get_target();
 		if (target == config_enet.mask)
 		{
@@ -91,8 +102,11 @@ static void main_handle(void)
 	}
 
 	link_check_rx();
+	link_check_time();
 	net_transmit_check();
+	hdd_open_check();
 	hdd_contiguous_check();
+	hdd_prefetch_check();
 	exec_count++;
 }
 
@@ -139,12 +153,16 @@ int main(void)
 		return 0;
 	}
 
-	// complete setup
+	/*
+	 * Complete setup. The drive images are opened later from the main loop,
+	 * so the PHY can start answering selections as soon as possible; until
+	 * then the drives report that they are becoming ready.
+	 */
 	phy_init(target_masks);
 	if (config_enet.id != 255)
 	{
 		// only enable networking if asked
-		net_setup(config_enet.mac);
+		net_setup(config_enet.mac, config_enet.xmit);
 		link_init();
 	}
 	uint16_t hdd_init_res = hdd_init();
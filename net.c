@@ -28,23 +28,61 @@
 #include "net.h"
 
 /*
- * Defines the high byte value for end of the region where the receive buffer
- * is, starting at 0x0000 and extending through 0xXXFF, where 0xXX is this
- * value. All remaining space is allocated to the transmit buffer.
+ * Each transmit buffer needs room for the control byte, the largest frame,
+ * and the seven byte status vector written after transmission.
  */
-#define NET_ERXNDH_VALUE        0x19
+#define NET_FRAME_MAX           1518
+#if (NET_XMIT_PAGES << 8) < (1 + NET_FRAME_MAX + 7)
+	#error "NET_XMIT_PAGES is too small for the largest frame"
+#endif
 
 /*
- * Defines the starting point where packets to be transmitted are stored.
- * There is one region, 1536 bytes in size, reserved for this purpose.
+ * The receive buffer starts at 0x0000 and extends through 0xXXFF, where 0xXX
+ * is rx_endh; ending on a page boundary keeps ERXND odd, as errata 14 needs.
+ * The transmit buffers follow it, each NET_XMIT_PAGES long. With two, the
+ * next frame can be written into one while the other is being sent. These
+ * are set once by net_setup().
  */
-#define NET_XMIT_BUF            0x1A
+static uint8_t rx_endh;
+static uint16_t rx_end;
+static uint8_t tx_slots;
+
+// start of the data not yet released from the receive buffer
+static uint16_t rx_read;
+
+/*
+ * Provides the starting high byte of the transmit buffer selected by
+ * NETFLAG_TXBUF in the given flags.
+ */
+static inline __attribute__((always_inline)) uint8_t net_xmit_slot(uint8_t f)
+{
+	uint8_t slot = rx_endh + 1;
+	if (tx_slots > 1 && (f & NETFLAG_TXBUF)) slot += NET_XMIT_PAGES;
+	return slot;
+}
 
 /*
  * Header for the received packet.
  */
 volatile NetHeader net_header;
 
+/*
+ * Driver statistics.
+ */
+NetStats net_stats;
+
+/*
+ * Ring of packet headers fetched by the ISRs, oldest first, along with where
+ * the data for each packet starts in the RX buffer. The oldest is also copied
+ * into net_header. rx_walk is the address of the next header to be fetched;
+ * whenever /E_INT is enabled, ERDPT is left pointing there.
+ */
+static volatile NetHeader queue[NET_HEADER_QUEUE];
+static volatile uint16_t queue_data[NET_HEADER_QUEUE];
+static volatile uint8_t queue_head;
+static volatile uint8_t queue_count;
+static volatile uint16_t rx_walk;
+
 /*
  * Two arrays of equal length for the DMA units involved with reading packet
  * headers; one array is fixed for the write side (including the RBM command)
@@ -78,10 +116,21 @@ static const uint8_t dma_write_arr[] = { ENC_OP_RBM,
 // the eight hash table bytes
 static uint8_t hash_table[8];
 
+// length of the frame waiting behind the one being sent, if NETFLAG_TXQUEUE
+static uint16_t tx_queue_length;
+
+/*
+ * Packet data is moved between the ENC28J60 and the client function in chunks
+ * of this size, using two buffers: the DMA units move one over SPI while the
+ * client moves the other, so the two transfers overlap.
+ */
+#define NET_CHUNK_LENGTH        32
+static uint8_t chunk_buf[2][NET_CHUNK_LENGTH];
+
 /*
  * This (re-)enables the /E_INT interrupt routine. That ISR is auto-disabled at
  * the start of each packet reception event. This should only be used when
- * the packet header buffer is empty.
+ * the packet header queue has room and ERDPT is at rx_walk.
  * 
  * This will clear the ISR flag before enabling the interrupt to avoid
  * spurrious triggers. /E_INT is level triggered when active, so the flag will
@@ -108,6 +157,96 @@ static inline __attribute__((always_inline)) void net_timer_reset(void)
 	NET_TIMER.CTRLA = TC_CLKSEL_DIV1024_gc;
 }
 
+/*
+ * Sets up the DMA units for fetching packet headers, as the ISRs expect. This
+ * must only be called while locked, or before the ISRs are enabled.
+ */
+static void net_dma_header(void)
+{
+	NET_DMA_WRITE.SRCADDR0 = (uint8_t) ((uint16_t) (&dma_write_arr));
+	NET_DMA_WRITE.SRCADDR1 = (uint8_t) (((uint16_t) (&dma_write_arr)) >> 8);
+	NET_DMA_WRITE.SRCADDR2 = 0;
+	NET_DMA_WRITE.DESTADDR0 = (uint8_t) ((uint16_t) &ENC_USART);
+	NET_DMA_WRITE.DESTADDR1 = (uint8_t) (((uint16_t) (&ENC_USART)) >> 8);
+	NET_DMA_WRITE.DESTADDR2 = 0;
+	NET_DMA_WRITE.ADDRCTRL = DMA_CH_SRCDIR_INC_gc | DMA_CH_SRCRELOAD_TRANSACTION_gc;
+	NET_DMA_WRITE.CTRLA = NET_DMA_CTRLA;
+	NET_DMA_WRITE.TRIGSRC = ENC_DMA_TX_TRIG;
+	NET_DMA_WRITE.TRFCNT = NET_DMA_BUFFER_LENGTH;
+	NET_DMA_READ.SRCADDR0 = (uint8_t) ((uint16_t) &ENC_USART);
+	NET_DMA_READ.SRCADDR1 = (uint8_t) (((uint16_t) (&ENC_USART)) >> 8);
+	NET_DMA_READ.SRCADDR2 = 0;
+	NET_DMA_READ.DESTADDR0 = (uint8_t) ((uint16_t) (&dma_read_arr));
+	NET_DMA_READ.DESTADDR1 = (uint8_t) (((uint16_t) (&dma_read_arr)) >> 8);
+	NET_DMA_READ.DESTADDR2 = 0;
+	NET_DMA_READ.ADDRCTRL = DMA_CH_DESTDIR_INC_gc | DMA_CH_DESTRELOAD_TRANSACTION_gc;
+	NET_DMA_READ.CTRLA = NET_DMA_CTRLA;
+	NET_DMA_READ.CTRLB = DMA_CH_TRNIF_bm | DMA_CH_TRNINTLVL_LO_gc;
+	NET_DMA_READ.TRIGSRC = ENC_DMA_RX_TRIG;
+	NET_DMA_READ.TRFCNT = NET_DMA_BUFFER_LENGTH;
+}
+
+/*
+ * Sets up the DMA units for moving packet data in chunks with
+ * net_dma_chunk(), instead of fetching headers, in the given direction. Both
+ * units are used either way: on reads, the write unit clocks out 0xFF bytes;
+ * on writes, the read unit collects the garbage replies, so waiting on it
+ * also waits for the last byte to finish. This must only be called while
+ * locked, and net_dma_header() must be called once done.
+ */
+static void net_dma_stream(uint8_t write)
+{
+	if (write)
+	{
+		NET_DMA_WRITE.ADDRCTRL = DMA_CH_SRCDIR_INC_gc | DMA_CH_SRCRELOAD_NONE_gc;
+		// byte 0 is the RBM response and is never used
+		NET_DMA_READ.DESTADDR0 = (uint8_t) ((uint16_t) (&dma_read_arr));
+		NET_DMA_READ.DESTADDR1 = (uint8_t) (((uint16_t) (&dma_read_arr)) >> 8);
+		NET_DMA_READ.ADDRCTRL = DMA_CH_DESTDIR_FIXED_gc | DMA_CH_DESTRELOAD_NONE_gc;
+	}
+	else
+	{
+		NET_DMA_WRITE.SRCADDR0 = (uint8_t) ((uint16_t) (&dma_write_arr[1]));
+		NET_DMA_WRITE.SRCADDR1 = (uint8_t) (((uint16_t) (&dma_write_arr[1])) >> 8);
+		NET_DMA_WRITE.ADDRCTRL = DMA_CH_SRCDIR_FIXED_gc | DMA_CH_SRCRELOAD_NONE_gc;
+		NET_DMA_READ.ADDRCTRL = DMA_CH_DESTDIR_INC_gc | DMA_CH_DESTRELOAD_NONE_gc;
+	}
+	NET_DMA_READ.CTRLB = DMA_CH_TRNIF_bm;
+}
+
+/*
+ * Starts the DMA units moving a chunk of packet data between the given buffer
+ * and the ENC28J60, in the direction given to net_dma_stream(). The previous
+ * chunk must be finished first; see net_dma_wait().
+ */
+static void net_dma_chunk(uint8_t* buf, uint8_t length, uint8_t write)
+{
+	if (write)
+	{
+		NET_DMA_WRITE.SRCADDR0 = (uint8_t) ((uint16_t) buf);
+		NET_DMA_WRITE.SRCADDR1 = (uint8_t) (((uint16_t) buf) >> 8);
+	}
+	else
+	{
+		NET_DMA_READ.DESTADDR0 = (uint8_t) ((uint16_t) buf);
+		NET_DMA_READ.DESTADDR1 = (uint8_t) (((uint16_t) buf) >> 8);
+	}
+	NET_DMA_WRITE.TRFCNT = length;
+	NET_DMA_READ.TRFCNT = length;
+
+	// the read unit goes first so it is ready for the first reply
+	NET_DMA_READ.CTRLA = NET_DMA_STARTCMD;
+	NET_DMA_WRITE.CTRLA = NET_DMA_STARTCMD;
+}
+
+/*
+ * Waits for the chunk started by net_dma_chunk() to finish.
+ */
+static inline __attribute__((always_inline)) void net_dma_wait(void)
+{
+	while (NET_DMA_READ.CTRLA & DMA_CH_ENABLE_bm);
+}
+
 /*
  * Used by net.h calls that may be invoked when the /E_INT interrupt is live,
  * and thus will be vulnerable to having their communications trashed. This
@@ -118,8 +257,10 @@ static void net_lock(void)
 	/*
 	 * Disable /E_INT reception interrupts to avoid that mucking with
 	 * transactions the client wants to execute. This disables all port
-	 * interrupts, per the configuration contract.
+	 * interrupts, per the configuration contract. The flag keeps the DMA
+	 * ISR from turning them back on if it is still running.
 	 */
+	NET_FLAGS |= NETFLAG_LOCKED;
 	ENC_PORT_EXT.INTCTRL = 0;
 
 	/*
@@ -137,27 +278,32 @@ static void net_lock(void)
  */
 static void net_unlock(void)
 {
-	if (! net_pending())
+	NET_FLAGS &= ~NETFLAG_LOCKED;
+	if (queue_count < NET_HEADER_QUEUE)
 	{
 		net_enable_isr();
 	}
 }
 
 /*
- * Moves ERXRDPT (and optionally ERDPT) to the given address, following
- * the requirements of erratas 5 and 14.
+ * Moves ERDPT to the given address. This must only be called while locked.
  */
-static void net_move_rxpt(uint16_t next, uint8_t move_erdpt)
+static void net_move_erdpt(uint16_t ptr)
+{
+	enc_cmd_write(ENC_ERDPTL, (uint8_t) ptr);
+	enc_cmd_write(ENC_ERDPTH, (uint8_t) (ptr >> 8));
+}
+
+/*
+ * Moves ERXRDPT to the given address, following the requirements of erratas 5
+ * and 14.
+ */
+static void net_move_rxpt(uint16_t next)
 {
-	if (move_erdpt)
-	{
-		enc_cmd_write(ENC_ERDPTL, (uint8_t) next);
-		enc_cmd_write(ENC_ERDPTH, (uint8_t) (next >> 8));
-	}
 	if(next == 0)
 	{
 		enc_cmd_write(ENC_ERXRDPTL, 0xFF);
-		enc_cmd_write(ENC_ERXRDPTH, NET_ERXNDH_VALUE);
+		enc_cmd_write(ENC_ERXRDPTH, rx_endh);
 	}
 	else
 	{
@@ -167,6 +313,100 @@ static void net_move_rxpt(uint16_t next, uint8_t move_erdpt)
 	}
 }
 
+/*
+ * Copies the queued header at the given index into net_header.
+ */
+static inline __attribute__((always_inline)) void net_header_load(uint8_t idx)
+{
+	net_header.next_packet = queue[idx].next_packet;
+	net_header.length = queue[idx].length;
+	net_header.statl = queue[idx].statl;
+	net_header.stath = queue[idx].stath;
+}
+
+/*
+ * Frees the RX buffer space used by the pending packet and moves on to the
+ * next queued header, if there is one. This must only be called while locked
+ * and when a packet is pending.
+ */
+static void net_release(void)
+{
+	// note how much of the receive buffer was in use before freeing this
+	uint8_t rd, rdh;
+	enc_cmd_read(ENC_ERXWRPTL, &rd);
+	enc_cmd_read(ENC_ERXWRPTH, &rdh);
+	uint16_t used = ((rdh << 8) | rd) - rx_read;
+	if (used > rx_end) used += rx_end + 1;
+	if (used > net_stats.rx_peak) net_stats.rx_peak = used;
+	if (queue_count > net_stats.queue_peak) net_stats.queue_peak = queue_count;
+
+	rx_read = net_header.next_packet;
+	net_move_rxpt(rx_read);
+	net_stats.rx_frames++;
+
+	// note any receive errors since the last packet was released
+	enc_cmd_read(ENC_EIR, &rd);
+	if (rd & ENC_RXERIF_bm)
+	{
+		enc_cmd_read(ENC_EPKTCNT, &rd);
+		if (rd == 0xFF)
+		{
+			net_stats.rx_full++;
+		}
+		else
+		{
+			net_stats.rx_overflow++;
+		}
+		enc_cmd_clear(ENC_EIR, ENC_RXERIF_bm);
+	}
+
+	queue_head++;
+	if (queue_head >= NET_HEADER_QUEUE) queue_head = 0;
+	queue_count--;
+	if (queue_count)
+	{
+		net_header_load(queue_head);
+		NET_FLAGS &= ~NETFLAG_PKT_CHECKED;
+	}
+	else
+	{
+		NET_FLAGS &= ~(NETFLAG_PKT_PENDING | NETFLAG_PKT_CHECKED);
+	}
+}
+
+/*
+ * Starts transmission of the frame in the buffer with the given starting high
+ * byte. This mostly follows the steps in 7.1, amended by errata 12. This must
+ * only be called while locked and when no transmission is in progress.
+ */
+static void net_transmit_start(uint8_t slot, uint16_t length)
+{
+	// per errata 12, reset TX to prevent stalled transmissions
+	enc_cmd_set(ENC_ECON1, ENC_TXRST_bm);
+	enc_cmd_clear(ENC_ECON1, ENC_TXRST_bm);
+	enc_cmd_clear(ENC_EIR, ENC_TXIF_bm | ENC_TXERIF_bm);
+
+	/*
+	 * Program ETXST and ETXND for the correct data buffer.
+	 * 
+	 * The given length is the total length of the packet. With the extra
+	 * status byte on the front of the buffer, this is OK to use as the
+	 * addition for the ending pointer.
+	 */
+	enc_cmd_write(ENC_ETXSTL, 0x00);
+	enc_cmd_write(ENC_ETXSTH, slot);
+	uint16_t end = (slot << 8) + length;
+	enc_cmd_write(ENC_ETXNDL, (uint8_t) end);
+	enc_cmd_write(ENC_ETXNDH, (uint8_t) (end >> 8));
+
+	// set ECON1.TXRTS, which starts transmission
+	enc_cmd_set(ENC_ECON1, ENC_TXRTS_bm);
+	NET_FLAGS |= NETFLAG_TXREQ;
+
+	// reset the information for next time
+	net_timer_reset();
+}
+
 /*
  * ============================================================================
  *   PUBLIC FUNCTIONS
@@ -176,33 +416,21 @@ static void net_move_rxpt(uint16_t next, uint8_t move_erdpt)
 /*
  * See section 6 in the datasheet for the process this code uses.
  */
-void net_setup(uint8_t* mac)
+void net_setup(uint8_t* mac, uint8_t xmit)
 {
+	/*
+	 * Split the buffer memory between the receive ring and the transmit
+	 * buffers.
+	 */
+	tx_slots = (xmit == 1) ? 1 : 2;
+	rx_endh = NET_BUFFER_PAGES - tx_slots * NET_XMIT_PAGES - 1;
+	rx_end = (rx_endh << 8) | 0xFF;
+
 	/*
 	 * Setup DMA channels. We use two DMA units for handling packet header
 	 * reading, which would otherwise occupy significant interrupt time.
 	 */
-	NET_DMA_WRITE.SRCADDR0 = (uint8_t) ((uint16_t) (&dma_write_arr));
-	NET_DMA_WRITE.SRCADDR1 = (uint8_t) (((uint16_t) (&dma_write_arr)) >> 8);
-	NET_DMA_WRITE.SRCADDR2 = 0;
-	NET_DMA_WRITE.DESTADDR0 = (uint8_t) ((uint16_t) &ENC_USART);
-	NET_DMA_WRITE.DESTADDR1 = (uint8_t) (((uint16_t) (&ENC_USART)) >> 8);
-	NET_DMA_WRITE.DESTADDR2 = 0;
-	NET_DMA_WRITE.ADDRCTRL = DMA_CH_SRCDIR_INC_gc | DMA_CH_SRCRELOAD_TRANSACTION_gc;
-	NET_DMA_WRITE.CTRLA = NET_DMA_CTRLA;
-	NET_DMA_WRITE.TRIGSRC = ENC_DMA_TX_TRIG;
-	NET_DMA_WRITE.TRFCNT = NET_DMA_BUFFER_LENGTH;
-	NET_DMA_READ.SRCADDR0 = (uint8_t) ((uint16_t) &ENC_USART);
-	NET_DMA_READ.SRCADDR1 = (uint8_t) (((uint16_t) (&ENC_USART)) >> 8);
-	NET_DMA_READ.SRCADDR2 = 0;
-	NET_DMA_READ.DESTADDR0 = (uint8_t) ((uint16_t) (&dma_read_arr));
-	NET_DMA_READ.DESTADDR1 = (uint8_t) (((uint16_t) (&dma_read_arr)) >> 8);
-	NET_DMA_READ.DESTADDR2 = 0;
-	NET_DMA_READ.ADDRCTRL = DMA_CH_DESTDIR_INC_gc | DMA_CH_DESTRELOAD_TRANSACTION_gc;
-	NET_DMA_READ.CTRLA = NET_DMA_CTRLA;
-	NET_DMA_READ.CTRLB = DMA_CH_TRNINTLVL_LO_gc;
-	NET_DMA_READ.TRIGSRC = ENC_DMA_RX_TRIG;
-	NET_DMA_READ.TRFCNT = NET_DMA_BUFFER_LENGTH;
+	net_dma_header();
 
 	/*
 	 * 6.1: setup RX buffer.
@@ -229,9 +457,9 @@ void net_setup(uint8_t* mac)
 	enc_cmd_write(ENC_ERXSTL, 0x00);
 	enc_cmd_write(ENC_ERXSTH, 0x00);
 	enc_cmd_write(ENC_ERXNDL, 0xFF);
-	enc_cmd_write(ENC_ERXNDH, NET_ERXNDH_VALUE);
+	enc_cmd_write(ENC_ERXNDH, rx_endh);
 	enc_cmd_write(ENC_ERXRDPTL, 0xFF);
-	enc_cmd_write(ENC_ERXRDPTH, NET_ERXNDH_VALUE);
+	enc_cmd_write(ENC_ERXRDPTH, rx_endh);
 	enc_cmd_write(ENC_ERDPTL, 0x00);
 	enc_cmd_write(ENC_ERDPTH, 0x00);
 
@@ -398,41 +626,92 @@ NETSTAT net_skip(void)
 		return NETSTAT_NO_DATA;
 	}
 
-	net_move_rxpt(net_header.next_packet, 1);
-	NET_FLAGS &= ~NETFLAG_PKT_PENDING;
-	net_enable_isr();
+	net_lock();
+	net_release();
+	net_unlock();
 	return NETSTAT_OK;
 }
 
-NETSTAT net_stream_read(uint16_t (*func)(USART_t*, uint16_t))
+NETSTAT net_peek(uint8_t* buf, uint8_t length)
 {
 	if (! net_pending())
 	{
 		return NETSTAT_NO_DATA;
 	}
 
-	// ERDPT is already at the start of packet data, just start reading
-	enc_read_start();
-	uint16_t rxlen = net_header.length;
-	uint16_t remaining = func(&ENC_USART, rxlen);
-	enc_data_end();
+	NETSTAT res = NETSTAT_OK;
+	if (net_header.length < length)
+	{
+		length = (uint8_t) net_header.length;
+		res = NETSTAT_TRUNCATED;
+	}
 
 	/*
-	 * Move to the next packet. If the packet length was even, and we sent all
-	 * bytes requested, there is no need to move ERDPT.
+	 * Read from the start of packet data, then put ERDPT back where the ISRs
+	 * expect it. The read wraps around the end of the RX buffer by itself.
 	 */
-	if ((! (rxlen & 1)) && remaining == 0)
+	net_lock();
+	net_move_erdpt(queue_data[queue_head]);
+	enc_read_start();
+	for (uint8_t i = 0; i < length; i++)
 	{
-		net_move_rxpt(net_header.next_packet, 0);
+		buf[i] = enc_swap(0xFF);
 	}
-	else
+	enc_data_end();
+	net_move_erdpt(rx_walk);
+	net_unlock();
+
+	return res;
+}
+
+NETSTAT net_stream_read(uint16_t (*func)(uint8_t*, uint16_t))
+{
+	if (! net_pending())
 	{
-		net_move_rxpt(net_header.next_packet, 1);
+		return NETSTAT_NO_DATA;
 	}
 
-	// no longer have a packet pending
-	NET_FLAGS &= ~NETFLAG_PKT_PENDING;
-	net_enable_isr();
+	// read from the start of packet data
+	net_lock();
+	net_move_erdpt(queue_data[queue_head]);
+	enc_read_start();
+	net_dma_stream(0);
+
+	/*
+	 * Fetch the first chunk, then each time one arrives start fetching the
+	 * next into the other buffer before handing the arrived one over.
+	 */
+	uint16_t remaining = net_header.length;
+	uint16_t fetch = remaining;
+	uint8_t idx = 0;
+	uint8_t len = (fetch > NET_CHUNK_LENGTH) ? NET_CHUNK_LENGTH : fetch;
+	if (len) net_dma_chunk(chunk_buf[0], len, 0);
+	fetch -= len;
+	while (len)
+	{
+		net_dma_wait();
+		uint8_t* chunk = chunk_buf[idx];
+		idx ^= 1;
+
+		uint8_t next = (fetch > NET_CHUNK_LENGTH) ? NET_CHUNK_LENGTH : fetch;
+		if (next) net_dma_chunk(chunk_buf[idx], next, 0);
+		fetch -= next;
+
+		if (func(chunk, len) != len)
+		{
+			net_dma_wait();
+			break;
+		}
+		remaining -= len;
+		len = next;
+	}
+	enc_data_end();
+	net_dma_header();
+
+	// put ERDPT back at the next header to fetch and move to the next packet
+	net_move_erdpt(rx_walk);
+	net_release();
+	net_unlock();
 
 	// report result of operation
 	if (remaining)
@@ -445,13 +724,22 @@ NETSTAT net_stream_read(uint16_t (*func)(USART_t*, uint16_t))
 	}
 }
 
-NETSTAT net_stream_write(void (*func)(USART_t*, uint16_t), uint16_t length)
+uint8_t net_queued(void)
+{
+	return queue_count;
+}
+
+NETSTAT net_stream_write(uint16_t (*func)(uint8_t*, uint16_t),
+		uint16_t length)
 {
 	/*
-	 * Ensure the previous transmission completed to avoid overwriting the
-	 * existing buffer.
+	 * The free buffer is only in use when a frame is queued behind one being
+	 * sent; wait for the queued frame to start before overwriting it.
+	 * Otherwise the write goes ahead while the other buffer is on the wire.
+	 * With a single buffer, wait for the frame in it to be sent.
 	 */
-	while (NET_FLAGS & NETFLAG_TXREQ)
+	uint8_t busy = (tx_slots > 1) ? NETFLAG_TXQUEUE : NETFLAG_TXREQ;
+	while (NET_FLAGS & busy)
 	{
 		net_transmit_check();
 	}
@@ -461,62 +749,69 @@ NETSTAT net_stream_write(void (*func)(USART_t*, uint16_t), uint16_t length)
 
 	// reset the write pointer
 	enc_cmd_write(ENC_EWRPTL, 0x00);
-	enc_cmd_write(ENC_EWRPTH, NET_XMIT_BUF);
+	enc_cmd_write(ENC_EWRPTH, net_xmit_slot(NET_FLAGS));
 	// setup write
 	enc_write_start();
 	// write the status byte
 	enc_swap(0x00);
-	// transfer raw data
-	func(&ENC_USART, length);
+
+	/*
+	 * Fill a chunk from the client, then send it while filling the other. If
+	 * the client comes up short (the initiator stopped sending) the frame is
+	 * abandoned, and must not be transmitted.
+	 */
+	NETSTAT res = NETSTAT_OK;
+	net_dma_stream(1);
+	uint8_t idx = 0;
+	while (length)
+	{
+		uint8_t len = (length > NET_CHUNK_LENGTH) ? NET_CHUNK_LENGTH : length;
+		if (func(chunk_buf[idx], len) != len)
+		{
+			res = NETSTAT_TRUNCATED;
+			break;
+		}
+		net_dma_wait();
+		net_dma_chunk(chunk_buf[idx], len, 1);
+		idx ^= 1;
+		length -= len;
+	}
+	net_dma_wait();
 	enc_data_end();
+	net_dma_header();
 
 	// done
 	net_unlock();
-	return NETSTAT_OK;
+	return res;
 }
 
-/*
- * This mostly follows the steps in 7.1, amended by errata 12.
- */
 NETSTAT net_transmit(uint16_t length)
 {
-	/*
-	 * Ensure the previous transmission completed. Per errata 13, when we are
-	 * operating in half-duplex mode there are false/late collision issues that
-	 * need to be worked around. This is handled in the below call.
-	 */
-	while (NET_FLAGS & NETFLAG_TXREQ)
-	{
-		net_transmit_check();
-	}
+	// catch a just-finished transmission so this one can start immediately
+	net_transmit_check();
 
 	// reserve
 	net_lock();
 
-	// per errata 12, reset TX to prevent stalled transmissions
-	enc_cmd_set(ENC_ECON1, ENC_TXRST_bm);
-	enc_cmd_clear(ENC_ECON1, ENC_TXRST_bm);
-	enc_cmd_clear(ENC_EIR, ENC_TXIF_bm | ENC_TXERIF_bm);
-
 	/*
-	 * Program ETXST and ETXND for the correct data buffer.
-	 * 
-	 * The given length is the total length of the packet. With the extra
-	 * status byte on the front of the buffer, this is OK to use as the
-	 * addition for the ending pointer.
+	 * If the other buffer is still being sent, leave this frame queued for
+	 * net_transmit_check() to start once that finishes. Per errata 13, when we
+	 * are operating in half-duplex mode there are false/late collision issues
+	 * that need to be worked around, which is also handled there.
 	 */
-	enc_cmd_write(ENC_ETXSTL, 0x00);
-	enc_cmd_write(ENC_ETXSTH, NET_XMIT_BUF);
-	uint16_t end = (NET_XMIT_BUF << 8) + length;
-	enc_cmd_write(ENC_ETXNDL, (uint8_t) end);
-	enc_cmd_write(ENC_ETXNDH, (uint8_t) (end >> 8));
-
-	// set ECON1.TXRTS, which starts transmission
-	enc_cmd_set(ENC_ECON1, ENC_TXRTS_bm);
-	NET_FLAGS |= NETFLAG_TXREQ;
+	uint8_t slot = net_xmit_slot(NET_FLAGS);
+	if (NET_FLAGS & NETFLAG_TXREQ)
+	{
+		tx_queue_length = length;
+		NET_FLAGS |= NETFLAG_TXQUEUE;
+	}
+	else
+	{
+		net_transmit_start(slot, length);
+	}
 
-	// reset the information for next time
-	net_timer_reset();
+	// the next frame goes in the other buffer
+	NET_FLAGS ^= NETFLAG_TXBUF;
 
 	// done
 	net_unlock();
@@ -536,12 +831,23 @@ NETSTAT net_transmit_check(void)
 		{
 			// packet transmission failed due to error, re-transmit
 			debug(DEBUG_NET_TX_ERROR_RETRANSMIT);
+			net_stats.tx_retry++;
 			reset = 1;
 		}
 		else if (rd & ENC_TXIF_bm)
 		{
 			// packet transmission OK!
 			NET_FLAGS &= ~NETFLAG_TXREQ;
+			net_stats.tx_ok++;
+
+			// start the frame waiting in the other buffer, which is the one
+			// that was not most recently written into
+			if (NET_FLAGS & NETFLAG_TXQUEUE)
+			{
+				NET_FLAGS &= ~NETFLAG_TXQUEUE;
+				net_transmit_start(net_xmit_slot(NET_FLAGS ^ NETFLAG_TXBUF),
+						tx_queue_length);
+			}
 		}
 		else
 		{
@@ -556,6 +862,7 @@ NETSTAT net_transmit_check(void)
 			{
 				// queue up a reset
 				debug(DEBUG_NET_TX_TIMEOUT_RETRANSMIT);
+				net_stats.tx_timeout++;
 				reset = 1;
 			}
 		}
@@ -602,9 +909,9 @@ NETSTAT net_transmit_check(void)
  * 
  * 1) /E_INT is only driven by packet reception. This removes the need to read
  *    EPKTCNT: if /E_INT is low, there is always a packet waiting.
- * 2) net_end() updates ERDPT to the position where the next packet will be
- *    before re-enabling this interrupt, removing the need to update those
- *    registers here: the RBM command will always pull from the right address.
+ * 2) ERDPT is always left at the next header to fetch while this interrupt is
+ *    enabled, removing the need to update those registers here: the RBM
+ *    command will always pull from the right address.
  * 3) The DMA channels are preconfigured to use the same memory buffers and
  *    reload their initial state on completion. All we need to do is start
  *    them to get the transaction rolling.
@@ -616,7 +923,7 @@ NETSTAT net_transmit_check(void)
  *    the packet header.
  * 3) Start the reading DMA unit to get the data that will be arriving on the
  *    SPI bus.
- * 4) Stop further /E_INT interrupts until we're ready to handle them again.
+ * 4) Stop further /E_INT interrupts until the header has been queued.
  * 
  * This is easy enough that the ISR is done "naked," to avoid GCC generating
  * the usual preamble/postamble. All these instructions leave SREG alone, thus
@@ -649,12 +956,33 @@ ISR(ENC_INT_ISR, ISR_NAKED)
 	);
 }
 
+/*
+ * Sends a two byte command to the ENC28J60 from the DMA ISR below, without
+ * the overhead of the enc.c library.
+ */
+static inline __attribute__((always_inline)) void net_isr_cmd(
+		uint8_t op, uint8_t arg)
+{
+	ENC_PORT.OUTCLR = ENC_PIN_CS;
+	ENC_USART.DATA = op;
+	ENC_USART.DATA = arg;
+	while (! (ENC_USART.STATUS & USART_RXCIF_bm));
+	ENC_USART.DATA;
+	while (! (ENC_USART.STATUS & USART_RXCIF_bm));
+	ENC_USART.DATA;
+	ENC_PORT.OUTSET = ENC_PIN_CS;
+	_NOP();
+	_NOP();
+}
+
 /*
  * Invoked when the read DMA unit completes a transaction, meaning the array
  * has a packet header needing to be parsed.
  * 
- * TODO: this isn't terribly efficient with the memory copying between the
- * array and the struct; this might be better to just do with the array.
+ * The header is added to the end of the queue, then ERDPT is moved to where
+ * the header after it will be. If the queue still has room, /E_INT is turned
+ * back on, so the ISRs keep walking ahead through the RX buffer while earlier
+ * packets are being handled, until the queue fills or no packets remain.
  */
 ISR(NET_DMA_READ_ISR)
 {
@@ -681,15 +1009,24 @@ ISR(NET_DMA_READ_ISR)
 	// we don't use the error flags, so ignore those
 	NET_DMA_READ.CTRLB |= DMA_CH_TRNIF_bm;
 
-	// decode the packet pointer and store
-	net_header.next_packet =
+	// decode the packet pointer and store at the end of the queue
+	uint8_t tail = queue_head + queue_count;
+	if (tail >= NET_HEADER_QUEUE) tail -= NET_HEADER_QUEUE;
+	uint16_t next =
 			(dma_read_arr[NET_HEAD_RXPTH] << 8)
 			+ dma_read_arr[NET_HEAD_RXPTL];
-	net_header.length =
+	queue[tail].next_packet = next;
+	queue[tail].length =
 			(dma_read_arr[NET_HEAD_RXLENH] << 8)
 			+ dma_read_arr[NET_HEAD_RXLENL];
-	net_header.statl = dma_read_arr[NET_HEAD_STATL];
-	net_header.stath = dma_read_arr[NET_HEAD_STATH];
+	queue[tail].statl = dma_read_arr[NET_HEAD_STATL];
+	queue[tail].stath = dma_read_arr[NET_HEAD_STATH];
+
+	// packet data follows the header, wrapping at the end of the RX buffer
+	uint16_t data = rx_walk + 6;
+	if (data > rx_end) data -= rx_end + 1;
+	queue_data[tail] = data;
+	rx_walk = next;
 
 	// clear received USART bytes (garbage response) and wrap up command
 	while (! (ENC_USART.STATUS & USART_RXCIF_bm));
@@ -697,7 +1034,27 @@ ISR(NET_DMA_READ_ISR)
 	while (! (ENC_USART.STATUS & USART_RXCIF_bm));
 	ENC_USART.DATA;
 	ENC_PORT.OUTSET = ENC_PIN_CS;
+	_NOP();
+	_NOP();
 
-	// flag that we have a packet waiting
-	NET_FLAGS |= NETFLAG_PKT_PENDING;
+	// move ERDPT to the next header, which lives in bank 0
+	uint8_t bank = ENC_BANK;
+	if (bank) net_isr_cmd(ENC_OP_BFC | ENC_ECON1, 0x03);
+	net_isr_cmd(ENC_OP_WCR | ENC_ERDPTL, (uint8_t) next);
+	net_isr_cmd(ENC_OP_WCR | ENC_ERDPTH, (uint8_t) (next >> 8));
+	if (bank) net_isr_cmd(ENC_OP_BFS | ENC_ECON1, bank);
+
+	// the first packet in the queue becomes the pending one
+	if (queue_count == 0)
+	{
+		net_header_load(tail);
+		NET_FLAGS |= NETFLAG_PKT_PENDING;
+	}
+	queue_count++;
+
+	// keep fetching headers while there is room for them
+	if (queue_count < NET_HEADER_QUEUE && ! (NET_FLAGS & NETFLAG_LOCKED))
+	{
+		net_enable_isr();
+	}
 }
@@ -39,6 +39,38 @@ typedef struct NetHeader_t {
 // if net_pending() is true, this contains the information about the packet
 extern volatile NetHeader net_header;
 
+/*
+ * Number of packet headers the interrupt handlers can fetch ahead of the
+ * packet being handled. The first is always the one in net_header.
+ */
+#define NET_HEADER_QUEUE        4
+
+/*
+ * The ENC28J60 buffer memory, in 256 byte pages, is split between the receive
+ * ring at the bottom and one or two transmit buffers at the top, each of
+ * NET_XMIT_PAGES. Fewer transmit buffers leave more room for received packets.
+ */
+#define NET_BUFFER_PAGES        32
+#define NET_XMIT_PAGES          6
+#define NET_XMIT_BUFFERS_MAX    2
+
+/*
+ * Counters kept by the driver for the statistics commands. Receive buffer
+ * errors are noticed (and counted once) as packets are released, so several
+ * errors close together may be counted as one. Client code may clear these.
+ */
+typedef struct NetStats_t {
+	uint32_t rx_frames;    // packets released by net_skip() or read
+	uint32_t rx_overflow;  // EIR.RXERIF with room left in EPKTCNT
+	uint32_t rx_full;      // EIR.RXERIF with EPKTCNT saturated
+	uint32_t tx_ok;        // packets sent
+	uint32_t tx_retry;     // retransmissions after EIR.TXERIF
+	uint32_t tx_timeout;   // retransmissions after a stalled send
+	uint16_t rx_peak;      // most receive buffer bytes in use
+	uint8_t queue_peak;    // most packet headers queued at once
+} NetStats;
+extern NetStats net_stats;
+
 /*
  * Options for providing to net_set_filter. For each of these, only
  * OR-filtering is used, so a packet matching *any* of these will be accepted.
@@ -61,11 +93,22 @@ typedef enum {
  * Flags within the NET_STATUS GPIOR
  * 
  * NETFLAG_PKT_PENDING: set if there is a pending packet to be read
- * NETFLAG_TXBUF: switched back and forth to support TX double-buffering
- * NETFLAG_TXUSED: set once the first packet has been sent
+ * NETFLAG_PKT_CHECKED: free for client code to set once it has decided to
+ *     keep the pending packet; cleared along with NETFLAG_PKT_PENDING
+ * NETFLAG_LOCKED: set while non-ISR code is using the ENC28J60, to keep the
+ *     header ISRs from re-enabling /E_INT
+ * NETFLAG_TXBUF: switched back and forth to support TX double-buffering,
+ *     selecting the buffer the next frame is written into
+ * NETFLAG_TXREQ: set while a frame is being transmitted
+ * NETFLAG_TXQUEUE: set when a frame is waiting for the one being transmitted
+ *     to finish
  */
 #define NETFLAG_PKT_PENDING     _BV(1)
+#define NETFLAG_TXBUF           _BV(2)
 #define NETFLAG_TXREQ           _BV(3)
+#define NETFLAG_TXQUEUE         _BV(4)
+#define NETFLAG_PKT_CHECKED     _BV(5)
+#define NETFLAG_LOCKED          _BV(6)
 
 /*
  * If nonzero, there is a network packet pending and the values in net_header
@@ -73,6 +116,13 @@ typedef enum {
  */
 #define net_pending()       (NET_FLAGS & NETFLAG_PKT_PENDING)
 
+/*
+ * Provides the number of packets whose headers have been fetched, including
+ * the pending one. If this is more than one, another packet can be handled
+ * right after the current one.
+ */
+uint8_t net_queued(void);
+
 /*
  * Initalizes the Ethernet controller by writing appropriate values to its
  * registers. This should be done immediately after a controller reset to
@@ -80,9 +130,11 @@ typedef enum {
  * correctly configured (i.e. enc_init() must have been called).
  * 
  * This needs to be given the MAC address to configure as the built-in ROM
- * address, in LSB to MSB order.
+ * address, in LSB to MSB order, and the number of transmit buffers to use
+ * (1 or NET_XMIT_BUFFERS_MAX); the rest of the memory is used for the receive
+ * buffer.
  */
-void net_setup(uint8_t*);
+void net_setup(uint8_t*, uint8_t);
 
 /*
  * Updates the built-in hash filter bytes. These are eight bytes maintained
@@ -118,44 +170,63 @@ NETSTAT net_set_filter(uint8_t ftype);
 NETSTAT net_skip(void);
 
 /*
- * Performs a read action, streaming packet data into the given function from
- * the Ethernet controller.
+ * Copies up to the given number of bytes from the start of the pending packet
+ * into the given array, without consuming the packet: a later read will still
+ * start at the beginning. Useful for filtering on the packet headers.
+ * 
+ * This will return NETSTAT_TRUNCATED if the packet is shorter than the number
+ * of bytes requested, in which case only the bytes in the packet are copied.
+ */
+NETSTAT net_peek(uint8_t* buf, uint8_t length);
+
+/*
+ * Performs a read action, streaming packet data from the Ethernet controller
+ * into the given function.
  * 
- * When invoked, this will start a read operation against the network packet
- * pointed to by NET_PACKET_PTR, then call the given function with the number
- * of bytes that should be read from the given USART. Once that returns, this
- * will move the read pointers past the packet.
+ * When invoked, this will start a read operation against the pending packet
+ * and have the DMA units fetch it in small chunks, calling the given function
+ * with each chunk and its length while the next one is fetched. Once done,
+ * this will move the read pointers past the packet.
  * 
- * The provided function should return the number of bytes that *were not*
- * sent through properly: returning zero indicates success.
+ * The provided function should return the number of bytes it sent through
+ * properly. If that is short of the chunk length, the rest of the packet is
+ * not read.
  * 
  * This will return NETSTAT_OK if all bytes were sent, and NETSTAT_TRUNCATED
  * if not all bytes were sent. The pending packet will be discarded in either
  * case.
  */ 
-NETSTAT net_stream_read(uint16_t (*func)(USART_t*, uint16_t));
+NETSTAT net_stream_read(uint16_t (*func)(uint8_t*, uint16_t));
 
 /*
  * Performs a buffer write, streaming data from the given function into the
  * Ethernet controller's free buffer. This does not actually transmit a packet:
- * for that, see net_transmit().
+ * for that, see net_transmit(). There are two transmit buffers, so this only
+ * has to wait when a frame is already queued behind one being sent.
+ * 
+ * When invoked, this will begin a write operation and write the status byte,
+ * then call the provided function to fill small chunks of the given total
+ * length, each of which the DMA units write to the ENC28J60 while the next is
+ * being filled.
  * 
- * When invoked, this will begin a write operation, write the status byte,
- * then call the provided function with the given number of bytes that need
- * to be provided into the ENC28J60 USART.
+ * This will return NETSTAT_OK if all bytes were written, or NETSTAT_TRUNCATED
+ * if the function provided fewer bytes than asked for, in which case the
+ * frame is incomplete and must not be transmitted.
  */
-NETSTAT net_stream_write(void (*func)(USART_t*, uint16_t), uint16_t length);
+NETSTAT net_stream_write(uint16_t (*func)(uint8_t*, uint16_t),
+		uint16_t length);
 
 /*
  * Transmits the packet in the current free buffer. Should be provided with the
- * length of the data to transmit.
+ * length of the data to transmit. If the other buffer is still being sent this
+ * returns right away, and the packet is sent by net_transmit_check() after.
  */
 NETSTAT net_transmit(uint16_t length);
 
 /*
  * Checks on the status of pending transactions. This should be called
  * intermittently in between normal transmissions to prevent the TX subsystem
- * from stalling.
+ * from stalling, and to start any packet queued behind the one being sent.
  */
 NETSTAT net_transmit_check(void);
 
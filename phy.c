@@ -500,92 +500,24 @@ uint16_t phy_data_offer_bulk(uint8_t* data, uint16_t len)
 	return len;
 }
 
-uint16_t phy_data_offer_stream(USART_t* usart, uint16_t len)
+uint16_t phy_data_offer_bulk_atn(uint8_t* data, uint16_t len)
 {
-	uint8_t v;
-
-	if (! (PHY_REGISTER_PHASE & 0x01)) return len;
-	if (! phy_is_active()) return len;
-	if (len == 0) return len;
-	phy_watchdog_start();
-
-	// queue first byte
-	while (! (usart->STATUS & USART_DREIF_bm));
-	usart->DATA = 0xFF;
-
-	while (--len)
-	{
-		// queue next byte, and wait for reply from previous
-		while (! (usart->STATUS & USART_DREIF_bm));
-		usart->DATA = 0xFF;
-		while (! (usart->STATUS & USART_RXCIF_bm));
-		v = usart->DATA;
-
-		// share results with initiator
-		while (phy_is_ack_asserted());
-		phy_data_set(v);
-		req_assert();
-		while (! phy_is_ack_asserted());
-		req_release();
-	}
-
-	// fetch the last byte we sent
-	while (! (usart->STATUS & USART_RXCIF_bm));
-	v = usart->DATA;
-
-	// and share that with the initiator
-	while (phy_is_ack_asserted());
-	phy_data_set(v);
-	req_assert();
-	while (! phy_is_ack_asserted());
-	req_release();
-
-	phy_watchdog_stop();
-	return len;
-}
-
-uint16_t phy_data_offer_stream_atn(USART_t* usart, uint16_t len)
-{
-	uint8_t v;
-
-	if (! (PHY_REGISTER_PHASE & 0x01)) return len;
-	if (! phy_is_active()) return len;
-	if (len == 0) return len;
+	if (! (PHY_REGISTER_PHASE & 0x01)) return 0;
+	if (! phy_is_active()) return 0;
 	phy_watchdog_start();
 
-	// queue first byte
-	while (! (usart->STATUS & USART_DREIF_bm));
-	usart->DATA = 0xFF;
-
-	while (--len && ! phy_is_atn_asserted())
+	uint16_t i;
+	for (i = 0; i < len && ! phy_is_atn_asserted(); i++)
 	{
-		// queue next byte, and wait for reply from previous
-		while (! (usart->STATUS & USART_DREIF_bm));
-		usart->DATA = 0xFF;
-		while (! (usart->STATUS & USART_RXCIF_bm));
-		v = usart->DATA;
-
-		// share results with initiator
 		while (phy_is_ack_asserted());
-		phy_data_set(v);
+		phy_data_set(data[i]);
 		req_assert();
 		while ((! phy_is_atn_asserted()) && (! phy_is_ack_asserted()));
 		req_release();
 	}
 
-	// fetch the last byte we sent
-	while (! (usart->STATUS & USART_RXCIF_bm));
-	v = usart->DATA;
-
-	// and share that with the initiator
-	while (phy_is_ack_asserted());
-	phy_data_set(v);
-	req_assert();
-	while ((! phy_is_atn_asserted()) && (! phy_is_ack_asserted()));
-	req_release();
-
 	phy_watchdog_stop();
-	return len;
+	return i;
 }
 
 uint8_t phy_data_ask(void)
@@ -663,57 +595,6 @@ uint16_t phy_data_ask_bulk(uint8_t* data, uint16_t len)
 	return len;
 }
 
-void phy_data_ask_stream(USART_t* usart, uint16_t len)
-{
-	uint8_t v;
-
-	// guard against calling when not in control
-	// note that ISR has the opposite guard
-	if (! phy_is_active()) return;
-	if (len == 0) return;
-	phy_watchdog_start();
-
-	uint8_t not_first = 0;
-	do
-	{
-		// verify the initiator has released /ACK
-		while (phy_is_ack_asserted());
-		// ask for a byte of data
-		req_assert();
-		// wait for initiator to give us the data
-		while (! (phy_is_ack_asserted()));
-		// read data from the bus
-		v = phy_data_get();
-		// let the initiator know we got the information
-		req_release();
-		// get the true data value, if needed
-		#ifdef PHY_PORT_DATA_IN_REVERSED
-			v = phy_reverse_table[v];
-		#endif
-
-		// write to the USART once it is ready
-		while (! (usart->STATUS & USART_DREIF_bm));
-		usart->DATA = v;
-		// wait for the previous byte to arrive, then pitch it
-		if (not_first)
-		{
-			while (! (usart->STATUS & USART_RXCIF_bm));
-			usart->DATA;
-		}
-		else
-		{
-			not_first = 1;
-		}
-	}
-	while (--len);
-
-	// get the response to the previous byte
-	while (! (usart->STATUS & USART_RXCIF_bm));
-	usart->DATA;
-
-	phy_watchdog_stop();
-}
-
 void phy_phase(uint8_t new_phase)
 {
 	if (! phy_is_active()) return;
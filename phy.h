@@ -199,23 +199,11 @@ uint16_t phy_data_offer_bulk(uint8_t*, uint16_t);
 uint8_t phy_data_offer_block(uint8_t*);
 
 /*
- * Used during DATA IN to take data from the given USART and send it to the
- * initiator.
- * 
- * The connected USART device needs to be in a form of an auto-increment mode
- * pointing at the correct location. This will exchange the given number of
- * bytes with the remote device.
- * 
- * This will return the number of bytes that could not be sent, and thus
- * returns 0 on success.
- */
-uint16_t phy_data_offer_stream(USART_t*, uint16_t);
-
-/*
- * Specialized version of _offer_stream(), for use with the link device. This
- * version will eagerly abort if /ATN becomes asserted.
+ * Specialized version of _offer_bulk(), for use with the link device. This
+ * version will eagerly abort if /ATN becomes asserted, returning the number
+ * of bytes sent before that happened.
  */
-uint16_t phy_data_offer_stream_atn(USART_t*, uint16_t);
+uint16_t phy_data_offer_bulk_atn(uint8_t*, uint16_t);
 
 /*
  * Asks the initiator for a byte of data, waits until it is available, then
@@ -235,15 +223,6 @@ uint16_t phy_data_ask_bulk(uint8_t*, uint16_t);
  */
 uint8_t phy_data_ask_block(uint8_t*);
 
-/*
- * Used during DATA OUT to take data from the initiator and send it to the
- * given USART.
- * 
- * The connected USART device needs to be in a form of an auto-increment mode
- * pointing at the correct location.
- */
-void phy_data_ask_stream(USART_t*, uint16_t);
-
 /*
  * ============================================================================
  *  
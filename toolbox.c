@@ -26,123 +26,187 @@
 
 static const __flash char str_directory[] = TOOLBOX_FOLDER;
 
-typedef enum {
-	LIST_COUNT = 0,
-	LIST_INDEX,
-	LIST_FIND
-} LSMODE;
+/*
+ * Index of the files in the shared directory, as the directory offsets of
+ * their entries. This is rebuilt each time the files are listed and used to
+ * open files directly after that. The index stays valid until the next
+ * listing or until a file is uploaded.
+ */
+static DIR index_dir;
+static DWORD index_ofs[TOOLBOX_MAX_FILES];
+static uint8_t index_count = 255; // 255 if not built
 
-static FIL fp;
-static uint8_t fp_index = 255;
-static uint32_t fp_pos;
-static uint32_t fp_size;
+/*
+ * Recently used files, kept open so switching between them is cheap.
+ */
+static FIL files[TOOLBOX_OPEN_FILES];
+static uint8_t files_id[TOOLBOX_OPEN_FILES]; // index + 1, or 0 if unused
+static uint8_t files_used[TOOLBOX_OPEN_FILES];
+static uint8_t files_tick;
 
 /*
- * Generic listing call for the shared file directory. This is integrated to
- * simplify file iteration/filtering. It operates in different modes:
- *
- * 1) in count mode, just counts the valid files and returns the number found.
- * 2) in name mode, it builds the file name return data in 40 byte chunks and
- *    pipes it out over the SCSI bus, returning 0 on error and the number of
- *    files found on success; make sure the bus is in the right mode before
- *    calling this.
- * 3) in find mode, it locates a file at fp_index and updates the file
- *    pointer, returning 0 on error and 1 on success; make sure the file is
- *    closed prior to invoking.
+ * The file being uploaded, if any, and the end of the data written to it so
+ * far, past which the final size may not reach.
+ */
+static FIL upload_fp;
+static uint8_t upload_open;
+static uint32_t upload_end;
+
+/*
+ * Limits on allocating uploads up front, which happens within the command
+ * while the bus is held: only files up to the given size are allocated, and
+ * the search for free space gives up after the given number of steps.
+ */
+#define TOOLBOX_EXPAND_MAX      0x800000 // 8MB
+#define TOOLBOX_EXPAND_STEPS    16
+
+/*
+ * Drops the file index and closes the files opened through it, for when the
+ * directory is about to be read again or has changed.
+ */
+static void toolbox_forget(void)
+{
+	for (uint8_t i = 0; i < TOOLBOX_OPEN_FILES; i++)
+	{
+		if (files_id[i])
+		{
+			f_close(&(files[i]));
+			files_id[i] = 0;
+		}
+	}
+	index_count = 255;
+}
+
+/*
+ * Builds the index for the shared file directory. If 'send' is true, this
+ * also builds the file name return data in 40 byte chunks and pipes it out
+ * over the SCSI bus; make sure the bus is in the right mode before calling
+ * this.
+ * 
+ * Returns true on success or false on failure.
  */
-static uint8_t toolbox_ls(LSMODE mode)
+static uint8_t toolbox_ls(uint8_t send)
 {
-	DIR dir;
 	FILINFO finfo;
 	FRESULT res;
-	uint8_t fcount = 0;
+	DWORD ofs;
 	char* fname;
 
+	// files may now have different indexes
+	toolbox_forget();
+	index_count = 0;
+
 	// save a bit of SRAM via the global buffer used later anyway
 	for (uint8_t i = 0; i < sizeof(str_directory); i++)
 	{
 		global_buffer[i] = str_directory[i];
 	}
 
-	res = f_opendir(&dir, (char*) global_buffer);
-	if (res == FR_OK)
+	res = f_opendir(&index_dir, (char*) global_buffer);
+	while (res == FR_OK && index_count < TOOLBOX_MAX_FILES)
 	{
-		res = f_readdir(&dir, &finfo);
-		while (res == FR_OK
-				&& finfo.fname[0] != 0
-				&& fcount < TOOLBOX_MAX_FILES)
-		{
-			if (finfo.fname[0] == '.') continue;
-			if (finfo.fattrib & AM_DIR) continue;
+		ofs = index_dir.dptr;
+		res = f_readdir(&index_dir, &finfo);
+		if (res != FR_OK || finfo.fname[0] == 0) break;
+		if (finfo.fname[0] == '.') continue;
+		if (finfo.fattrib & AM_DIR) continue;
 
-#if _USE_LFN
-			fname = *finfo.lfname ? finfo.lfname : finfo.fname;
-#else
-			fname = finfo.fname;
-#endif
+		fname = finfo.fname;
+		if (send)
+		{
+			uint16_t len = strlen(fname);
+			if (len > 32) len = 32;
+			memset(global_buffer, 0, 40);
+			global_buffer[0] = index_count;
+			global_buffer[1] = 1;
+			memcpy((char*) &(global_buffer[2]), fname, len);
+			global_buffer[36] = ((finfo.fsize) >> 24) & 0xFF;
+			global_buffer[37] = ((finfo.fsize) >> 16) & 0xFF;
+			global_buffer[38] = ((finfo.fsize) >> 8) & 0xFF;
+			global_buffer[39] = (finfo.fsize) & 0xFF;
 
-			if (mode == LIST_INDEX)
+			if (phy_data_offer_bulk(global_buffer, 40) != 40)
 			{
-				uint16_t len = strlen(fname);
-				if (len > 32) len = 32;
-				memset(global_buffer, 0, 40);
-				global_buffer[0] = fcount;
-				global_buffer[1] = 1;
-				memcpy((char*) &(global_buffer[2]), fname, len);
-				global_buffer[36] = ((finfo.fsize) >> 24) & 0xFF;
-				global_buffer[37] = ((finfo.fsize) >> 16) & 0xFF;
-				global_buffer[38] = ((finfo.fsize) >> 8) & 0xFF;
-				global_buffer[39] = (finfo.fsize) & 0xFF;
-
-				if (phy_data_offer_bulk(global_buffer, 40) != 40)
-				{
-					return 0;
-				}
+				res = FR_DISK_ERR;
+				break;
 			}
-			else if (mode == LIST_FIND)
-			{
-				if (fcount == fp_index)
-				{
-					res = f_chdir((char*) global_buffer);
-					if (res) return 0;
-					fp_size = finfo.fsize;
-					res = f_open(&fp, fname, FA_READ | FA_OPEN_EXISTING);
-					return (res == FR_OK ? 1 : 0);
-				}
-			}
-
-			fcount++;
-			res = f_readdir(&dir, &finfo);
 		}
+
+		index_ofs[index_count++] = ofs;
 	}
 
-	if (mode == LIST_FIND)
+	if (res != FR_OK)
 	{
+		index_count = 255;
 		return 0;
 	}
-	else
+	return 1;
+}
+
+/*
+ * Provides an open file for the given index, reusing one that was opened
+ * recently if possible, or NULL if there is no such file.
+ */
+static FIL* toolbox_file(uint8_t index)
+{
+	if (index_count == 255 && ! toolbox_ls(0)) return NULL;
+	if (index >= index_count) return NULL;
+
+	// use the file if it is open already, otherwise replace the oldest
+	uint8_t slot = 0;
+	for (uint8_t i = 0; i < TOOLBOX_OPEN_FILES; i++)
 	{
-		return fcount;
+		if (files_id[i] == index + 1)
+		{
+			files_used[i] = ++files_tick;
+			return &(files[i]);
+		}
+		if ((uint8_t) (files_tick - files_used[i])
+				> (uint8_t) (files_tick - files_used[slot]))
+		{
+			slot = i;
+		}
+	}
+
+	if (files_id[slot])
+	{
+		f_close(&(files[slot]));
+		files_id[slot] = 0;
+	}
+	if (f_openat(&(files[slot]), &index_dir, index_ofs[index]) != FR_OK)
+	{
+		return NULL;
 	}
+	files_id[slot] = index + 1;
+	files_used[slot] = ++files_tick;
+	return &(files[slot]);
 }
 
 static void toolbox_index(void)
 {
 	phy_phase(PHY_PHASE_DATA_IN);
-	toolbox_ls(LIST_INDEX);
+	toolbox_ls(1);
 	logic_status(LOGIC_STATUS_GOOD);
 	logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
 }
 
+/*
+ * Block helper for f_mread(), sending only the requested part of each sector:
+ * the first 'skip' bytes of the first sector are dropped, and no more than
+ * 'size' bytes are sent overall.
+ */
 static uint16_t toolbox_offer_size;
+static uint16_t toolbox_offer_skip;
 static uint8_t toolbox_offer_block(uint8_t* data)
 {
-	uint16_t size = 512;
-	if (toolbox_offer_size < 512)
+	uint16_t size = 512 - toolbox_offer_skip;
+	if (toolbox_offer_size < size)
 	{
 		size = toolbox_offer_size;
 	}
 	toolbox_offer_size -= size;
+	data += toolbox_offer_skip;
+	toolbox_offer_skip = 0;
 
 	if (phy_data_offer_bulk(data, size) == size)
 	{
@@ -154,87 +218,267 @@ static uint8_t toolbox_offer_block(uint8_t* data)
 	}
 }
 
+/*
+ * Handles both file read commands. 0xD1 reads the 4K block given by the
+ * offset in bytes 2-5, while 0xD5 reads from any byte offset given in bytes
+ * 2-5, for the number of bytes given in 7-8. Consecutive reads continue from
+ * where the file pointer was left, so a file read front to back in whole
+ * sectors never needs to seek.
+ */
 static void toolbox_read(uint8_t* cmd)
 {
 	FRESULT res;
-	uint8_t index = cmd[1];
 	uint32_t pos = ((uint32_t) cmd[2] << 24)
 		| ((uint32_t) cmd[3] << 16)
 		| ((uint32_t) cmd[4] << 8)
 		| ((uint32_t) cmd[5]);
-	pos <<= 12;
+	uint16_t len;
+	if (cmd[0] == 0xD1)
+	{
+		pos <<= 12;
+		len = 4096;
+	}
+	else
+	{
+		len = (cmd[7] << 8) | cmd[8];
+	}
+
+	FIL* fp = toolbox_file(cmd[1]);
+	if (fp == NULL)
+	{
+		logic_set_sense(SENSE_INVALID_CDB_ARGUMENT, 1);
+		logic_status(LOGIC_STATUS_CHECK_CONDITION);
+		logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+		return;
+	}
+	uint32_t size = f_size(fp);
+	if (pos > size)
+	{
+		logic_set_sense(SENSE_INVALID_CDB_ARGUMENT, 2);
+		logic_status(LOGIC_STATUS_CHECK_CONDITION);
+		logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+		return;
+	}
+	if (len > size - pos) len = size - pos;
 
-	// open file if not already at the one they're asking for
-	if (index != fp_index)
+	// move to the sector holding the position if not already there
+	uint16_t skip = pos & 511;
+	pos -= skip;
+	if (pos != f_tell(fp))
 	{
-		if (fp_index != 255)
+		res = f_lseek(fp, pos);
+		if (res)
 		{
-			f_close(&fp);
+			logic_set_sense(SENSE_INVALID_CDB_ARGUMENT, 2);
+			logic_status(LOGIC_STATUS_CHECK_CONDITION);
+			logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+			return;
 		}
+	}
 
-		fp_index = index;
+	/*
+	 * 64A3U has insufficient SRAM to load the full block for reading, but
+	 * the custom f_mread() lets us cheat by piping the output directly to
+	 * the bus, as a single multi-sector read from the card; requires using
+	 * the 512-byte block helper above.
+	 */
+	if (len > 0)
+	{
+		UINT blocks = ((uint32_t) skip + len + 511) >> 9;
+		toolbox_offer_size = len;
+		toolbox_offer_skip = skip;
 
-		if (! toolbox_ls(LIST_FIND))
+		phy_phase(PHY_PHASE_DATA_IN);
+		UINT act_len;
+		res = f_mread(fp, toolbox_offer_block, blocks, &act_len, 1);
+		if (res)
 		{
-			fp_index = 255;
-			logic_set_sense(SENSE_INVALID_CDB_ARGUMENT, 1);
+			logic_set_sense(SENSE_MEDIUM_ERROR, 0);
 			logic_status(LOGIC_STATUS_CHECK_CONDITION);
 			logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
 			return;
 		}
-		else
-		{
-			fp_pos = 0;
-			res = f_lseek(&fp, 0);
-			if (res)
-			{
-				logic_set_sense(SENSE_INVALID_CDB_ARGUMENT, 5);
-				logic_status(LOGIC_STATUS_CHECK_CONDITION);
-				logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
-				return;
-			}
-		}
 	}
 
-	// move to the new index if not already there
-	if (pos != fp_pos)
+	logic_status(LOGIC_STATUS_GOOD);
+	logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+}
+
+static void toolbox_count()
+{
+	// the index is reused if it has already been built
+	uint8_t files = 0;
+	if (index_count != 255 || toolbox_ls(0))
+	{
+		files = index_count;
+	}
+	phy_phase(PHY_PHASE_DATA_IN);
+	phy_data_offer(files);
+	logic_status(LOGIC_STATUS_GOOD);
+	logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+}
+
+/*
+ * Reports the FatFs sector cache counters, for tuning the cache size.
+ */
+static void toolbox_cache_stats()
+{
+	DWORD stats[2] = { 0, 0 };
+#if FF_WIN_CACHE && !FF_FS_READONLY
+	f_wincache_stats(&stats[0], &stats[1]);
+#endif
+	phy_phase(PHY_PHASE_DATA_IN);
+	for (uint8_t i = 0; i < 2; i++)
+	{
+		phy_data_offer((uint8_t) (stats[i] >> 24));
+		phy_data_offer((uint8_t) (stats[i] >> 16));
+		phy_data_offer((uint8_t) (stats[i] >> 8));
+		phy_data_offer((uint8_t) stats[i]);
+	}
+	logic_status(LOGIC_STATUS_GOOD);
+	logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+}
+
+/*
+ * Starts uploading a file into the shared directory, replacing any file with
+ * the same name. The name is sent during DATA OUT, with its length in byte 8.
+ * If the final size in bytes is given in bytes 2-5, the file is allocated
+ * contiguously up front when that is quick to do.
+ */
+static void toolbox_create(uint8_t* cmd)
+{
+	FRESULT res;
+	uint32_t size = ((uint32_t) cmd[2] << 24)
+		| ((uint32_t) cmd[3] << 16)
+		| ((uint32_t) cmd[4] << 8)
+		| ((uint32_t) cmd[5]);
+	uint8_t len = cmd[8];
+	if (len == 0 || len > TOOLBOX_MAX_NAME)
+	{
+		logic_cmd_illegal_arg(8);
+		return;
+	}
+
+	// build the path in the global buffer, after the directory name
+	uint8_t dlen = sizeof(str_directory) - 1;
+	for (uint8_t i = 0; i < dlen; i++)
+	{
+		global_buffer[i] = str_directory[i];
+	}
+	global_buffer[dlen] = '/';
+	char* name = (char*) &(global_buffer[dlen + 1]);
+	if (logic_data_out((uint8_t*) name, len) != len)
+	{
+		phy_phase(PHY_PHASE_BUS_FREE);
+		return;
+	}
+	name[len] = '\0';
+	for (uint8_t i = 0; i < len; i++)
 	{
-		res = f_lseek(&fp, pos);
-		if (! res)
+		if (name[i] == '/' || name[i] == '\\' || name[i] == '\0')
 		{
-			logic_set_sense(SENSE_INVALID_CDB_ARGUMENT, 2);
+			logic_set_sense(SENSE_INVALID_PARAMETER, i);
 			logic_status(LOGIC_STATUS_CHECK_CONDITION);
 			logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
 			return;
 		}
 	}
 
-	/*
-	 * 64A3U has insufficient SRAM to load the full 4K block for reading,
-	 * but the custom f_mread() lets us cheat by piping the output directly
-	 * to the bus; requires using the 512-byte block helper above.
-	 */
-	uint16_t blocks = 8;
-	uint32_t rem = fp_size - pos;
-	if (rem < 4096)
+	if (upload_open)
 	{
-		blocks = (rem >> 9); // div by 512
-		if (rem % 512) blocks++; // add a block if there is partial data
-		toolbox_offer_size = rem;
-		fp_pos = fp_size;
+		f_close(&upload_fp);
+		upload_open = 0;
 	}
-	else
+	toolbox_forget();
+
+	res = f_open(&upload_fp, (char*) global_buffer,
+			FA_CREATE_ALWAYS | FA_WRITE);
+	if (! res)
+	{
+		upload_open = 1;
+		upload_end = 0;
+		if (size > 0 && size <= TOOLBOX_EXPAND_MAX)
+		{
+			/*
+			 * Allocating in one piece is not required, so fall back to
+			 * growing the file as it is written if there is no room, or if
+			 * finding it takes too long. Nothing has been changed on the
+			 * card while still searching, so that can be abandoned.
+			 */
+			FSEXPAND ce;
+			uint8_t steps = TOOLBOX_EXPAND_STEPS;
+			res = f_expand_setup(&upload_fp, size, &ce);
+			while (! res && ce.rem > 0 && (ce.alloc || steps > 0))
+			{
+				if (! ce.alloc) steps--;
+				res = f_expand_step(&ce);
+			}
+			if (res == FR_DENIED) res = FR_OK;
+		}
+	}
+	// f_mwrite() needs the directory change written out first
+	if (! res) res = f_sync(&upload_fp);
+	if (res)
 	{
-		toolbox_offer_size = 4096;
-		fp_pos = pos + 4096;
+		logic_set_sense(SENSE_MEDIUM_ERROR, res);
+		logic_status(LOGIC_STATUS_CHECK_CONDITION);
+		logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+		return;
 	}
 
-	phy_phase(PHY_PHASE_DATA_IN);
-	uint16_t act_len;
-	res = f_mread(&fp, toolbox_offer_block, blocks, &act_len, 1);
+	logic_status(LOGIC_STATUS_GOOD);
+	logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+}
+
+/*
+ * Writes sectors to the file being uploaded, from the sector-aligned byte
+ * offset in bytes 2-5, for the number of sectors given in bytes 7-8. The data
+ * goes straight from the bus to the card. Consecutive writes continue from
+ * where the last one ended without seeking.
+ */
+static void toolbox_write(uint8_t* cmd)
+{
+	FRESULT res;
+	uint32_t pos = ((uint32_t) cmd[2] << 24)
+		| ((uint32_t) cmd[3] << 16)
+		| ((uint32_t) cmd[4] << 8)
+		| ((uint32_t) cmd[5]);
+	uint16_t blocks = (cmd[7] << 8) | cmd[8];
+
+	if (! upload_open)
+	{
+		logic_cmd_illegal_op(cmd[0]);
+		return;
+	}
+	if (pos & 511)
+	{
+		logic_cmd_illegal_arg(2);
+		return;
+	}
+
+	res = FR_OK;
+	if (pos != f_tell(&upload_fp))
+	{
+		res = f_lseek(&upload_fp, pos);
+	}
+	if (! res && blocks > 0)
+	{
+		phy_phase(PHY_PHASE_DATA_OUT);
+		UINT act_len;
+		res = f_mwrite(&upload_fp, phy_data_ask_block, blocks, &act_len);
+		if (pos + (uint32_t) act_len * 512 > upload_end)
+		{
+			upload_end = pos + (uint32_t) act_len * 512;
+		}
+		if (! res && act_len != blocks) res = FR_DENIED;
+
+		// growing the file leaves the FAT unwritten, which the next
+		// f_mread() or f_mwrite() from anywhere would refuse to work with
+		if (! res) res = f_sync(&upload_fp);
+	}
 	if (res)
 	{
-		logic_set_sense(SENSE_MEDIUM_ERROR, 0);
+		logic_set_sense(SENSE_MEDIUM_ERROR, res);
 		logic_status(LOGIC_STATUS_CHECK_CONDITION);
 		logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
 		return;
@@ -244,11 +488,43 @@ static void toolbox_read(uint8_t* cmd)
 	logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
 }
 
-static void toolbox_count()
+/*
+ * Finishes the upload, cutting the file down to the final size in bytes
+ * given in bytes 2-5. The size cannot reach past the data actually written,
+ * since the rest of the file would hold whatever was on the card before.
+ */
+static void toolbox_close(uint8_t* cmd)
 {
-	uint8_t files = toolbox_ls(LIST_COUNT);
-	phy_phase(PHY_PHASE_DATA_IN);
-	phy_data_offer(files);
+	FRESULT res;
+	uint32_t size = ((uint32_t) cmd[2] << 24)
+		| ((uint32_t) cmd[3] << 16)
+		| ((uint32_t) cmd[4] << 8)
+		| ((uint32_t) cmd[5]);
+
+	if (! upload_open)
+	{
+		logic_cmd_illegal_op(cmd[0]);
+		return;
+	}
+	if (size > upload_end)
+	{
+		logic_cmd_illegal_arg(2);
+		return;
+	}
+
+	res = f_lseek(&upload_fp, size);
+	if (! res) res = f_truncate(&upload_fp);
+	FRESULT cres = f_close(&upload_fp);
+	if (! res) res = cres;
+	upload_open = 0;
+	if (res)
+	{
+		logic_set_sense(SENSE_MEDIUM_ERROR, res);
+		logic_status(LOGIC_STATUS_CHECK_CONDITION);
+		logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
+		return;
+	}
+
 	logic_status(LOGIC_STATUS_GOOD);
 	logic_message_in(LOGIC_MSG_COMMAND_COMPLETE);
 }
@@ -261,11 +537,24 @@ uint8_t toolbox_main(uint8_t* cmd)
 			toolbox_index();
 			break;
 		case 0xD1:
+		case 0xD5:
 			toolbox_read(cmd);
 			break;
 		case 0xD2:
 			toolbox_count();
 			break;
+		case 0xD6:
+			toolbox_create(cmd);
+			break;
+		case 0xD7:
+			toolbox_write(cmd);
+			break;
+		case 0xD8:
+			toolbox_close(cmd);
+			break;
+		case 0xDA:
+			toolbox_cache_stats();
+			break;
 		default:
 			return 0;
 	}
@@ -24,6 +24,28 @@
 
 #define TOOLBOX_FOLDER          "/shared"
 #define TOOLBOX_MAX_FILES       64
+#define TOOLBOX_OPEN_FILES      2
+#define TOOLBOX_MAX_NAME        32
+
+/*
+ * The range of vendor-specific opcodes used by the toolbox. Most are handled
+ * by toolbox_main(), but drive-specific commands are handled by the hard
+ * drive code instead:
+ * 
+ * 0xD3: discards the copy-on-write overlay of the drive it is sent to.
+ * 0xD4: switches the drive it is sent to over to a different image file,
+ *       named by the DATA OUT bytes, with the length in byte 8.
+ * 
+ * 0xDA: reports the FatFs sector cache hits and misses, as two big-endian
+ *       DWORDs (zero when the cache is not built in).
+ * 
+ * The Ethernet controller handles one of its own:
+ * 
+ * 0xD9: reports the network statistics counters, with the allocation length
+ *       in bytes 7-8; if bit 0 of byte 1 is set they are cleared afterwards.
+ */
+#define TOOLBOX_OP_FIRST        0xD0
+#define TOOLBOX_OP_LAST         0xDA
 
 uint8_t toolbox_main(uint8_t *cmd);
 